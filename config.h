@@ -2,23 +2,30 @@
 #define _CONFIG_H_
 
 #include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 #include "lib/tcpsock.h"
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 
 #define LOG_FILE "gateway.log"
 #define DATA_FILE_NAME "data.csv"
 #define MAP_FILE "room_sensor.map"
+#define LIMITS_FILE "room_sensor.limits"    // optional temperature limits, read and reloaded with MAP_FILE
 
 /* Network settings */
 #define MIN_PORT 1024
 #define MAX_PORT 65536
 #define TIMEOUT 5  // Connection timeout in seconds
+#ifndef FRAME_TIMEOUT
+#define FRAME_TIMEOUT TIMEOUT   // max seconds from the first to the last byte of a reading or frame
+#endif
+#define TIMER_TICK_MS 100       // resolution of the connection timeouts
 
-/* Temperature thresholds */
+/* Temperature thresholds, used where LIMITS_FILE sets none */
 #ifndef SET_MIN_TEMP
 #define SET_MIN_TEMP 10
 #endif
@@ -27,13 +34,75 @@
 #define SET_MAX_TEMP 20
 #endif
 
+/* Alerts (-a option): which averages are checked against the thresholds */
+#define ALERT_SENSORS 1             // the running average of every sensor
+#define ALERT_ROOMS 2               // the mean of the running averages of the sensors in a room
+#define ROOM_STALE_AFTER 60         // seconds without a reading after which a sensor counts as stale in its room
+#define QUANTILE_REFRESH_INTERVAL 64    // readings of a sensor between two refreshes of the quantiles in its snapshot
+#define ALERT_HYSTERESIS 0.5        // default degrees an average must come back within the limits to end an alert (-y option)
+#define ALERT_INTERVAL 60           // default min seconds between two alerts of a sensor or room (-i option)
+#define ANOMALY_ALPHA 0.1           // weight of a new reading in the EWMA mean and variance of a sensor
+#define ANOMALY_WARMUP 10           // readings before a sensor's EWMA is trusted to flag jumps
+#define ANOMALY_MIN_STDDEV 0.1      // a steady sensor's deviation counts as at least this, so noise is no jump
+#define ANOMALY_FLAT_EPSILON 1e-9   // readings closer than this to the previous one count as the same
+#define ALERT_LEVEL_NORMAL 0
+#define ALERT_LEVEL_TOO_HOT 1
+#define ALERT_LEVEL_TOO_COLD -1
+
 /* Buffer and processing settings */
 #define LOG_MSG_MAX_LEN 300
-#define RUN_AVG_LENGTH 5
+#define RUN_AVG_LENGTH 5             // default readings in the running average of a sensor (-w option)
+#define RUN_AVG_MAX_LENGTH 4096     // upper limit for the running average window
+#define SBUFFER_CAPACITY 1024       // default max records in a shared buffer (-c option)
+#define SBUFFER_HIGH_WATERMARK 75   // default % of capacity at which connections stop reading their sockets (-H option)
+#define SBUFFER_LOW_WATERMARK 50    // default % of capacity at which they start reading again (-L option)
+#define SBUFFER_MAX_STAGES 32       // max consumers registered on one shared buffer
+#define SBUFFER_STAGE_NAME_LEN 32
+#define SBUFFER_BATCH_SIZE 64       // max records moved per lock acquisition by the batch APIs
+#define MAX_SHARDS 64               // upper limit for the number of independent pipelines (-s option)
+#define MAX_DATA_WORKERS 16         // upper limit for the data manager workers per shard (-d option)
+
+/* Rollup stage settings (-R option) */
+#define ROLLUP_MAX_RESOLUTIONS 4    // upper limit for the number of window lengths
+#define ROLLUP_MAX_RESOLUTION 86400 // longest window in seconds
+#define ROLLUP_GRACE 10             // seconds of readings after its end that a window of a silent sensor stays open
+#define ROLLUP_FILE_FORMAT "rollup_%ds.csv"
+
+/* Connection manager settings */
+#define MAX_IO_THREADS 64           // upper limit for the number of epoll I/O threads (-t option)
+#define MAX_LISTENERS 64            // upper limit for the number of SO_REUSEPORT listeners (-l option)
+#define EPOLL_MAX_EVENTS 64         // events handled per epoll_wait or io_uring wait call
+#define ACCEPT_POLL_MS 500          // how often the accept loop checks for a shutdown request
+
+/* Wire protocol, all fields in host byte order and without padding
+ * v1: a stream of <sensor_id><temperature><timestamp> readings
+ * v2: the node opens with the handshake <0><magic><version><sensor_id> and the gateway answers <magic><version>,
+ *     then the node sends frames <reading count><temperature><timestamp>...<temperature><timestamp>
+ * a v1 stream never starts with 0 (the end marker id), so both versions can share one port */
+#define PROTOCOL_VERSION 2                  // highest version the gateway and sensor nodes speak
+#define PROTOCOL_MAGIC 0x5332               // "S2"
+#define PROTOCOL_MAX_READINGS SBUFFER_BATCH_SIZE   // max readings in one v2 frame, so a frame fits in one batch
+#define PROTOCOL_FLUSH_INTERVAL 10          // default max seconds a sensor node holds readings back
+#define RECORD_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+#define HANDSHAKE_SIZE (4 * sizeof(uint16_t))
+#define HANDSHAKE_REPLY_SIZE (2 * sizeof(uint16_t))
+#define FRAME_HEADER_SIZE sizeof(uint16_t)
+#define FRAME_READING_SIZE (sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+
+/* UDP ingest (-u option), a datagram holds either
+ * - one or more v1 readings <sensor_id><temperature><timestamp>, or
+ * - one sequenced frame <0><magic><sensor_id><reading count><sequence> followed by v2 readings <temperature><timestamp>,
+ *   the uint32 sequence starts at 0 and grows by one per datagram so the gateway can count lost datagrams */
+#define UDP_MAX_DATAGRAM 1472               // largest payload that is not fragmented on Ethernet
+#define UDP_BATCH 64                        // datagrams read per recvmmsg call
+#define UDP_RECEIVE_BUFFER (4 * 1024 * 1024)    // requested socket receive buffer, absorbs bursts while the buffer is full
+#define UDP_HEADER_SIZE (4 * sizeof(uint16_t) + sizeof(uint32_t))
+#define UDP_MAX_READINGS ((UDP_MAX_DATAGRAM - UDP_HEADER_SIZE) / FRAME_READING_SIZE)
 
 
 /* Typedef */
 typedef uint16_t sensor_id_t;
+#define SENSOR_ID_COUNT (UINT16_MAX + 1)    // every possible sensor id, tables indexed by id have this size
 typedef double sensor_value_t;
 typedef time_t sensor_ts_t;
 
@@ -55,33 +124,112 @@ typedef enum {
  } status_t;
 
 typedef struct sbuffer sbuffer_t;
+typedef struct sbuffer_shards sbuffer_shards_t;
+
+typedef struct {
+   int checks;                  /**< ALERT_SENSORS and/or ALERT_ROOMS */
+   sensor_value_t hysteresis;   /**< an alert ends once the average is this far back within the limits */
+   int interval;                /**< min seconds of readings between two alerts of one sensor or room, 0 logs every reading */
+} alert_options_t;
+
+typedef struct {
+   sensor_value_t sigma;        /**< a reading further than this many standard deviations from the EWMA is a jump, 0 for off */
+   int flatline;                /**< this many identical readings in a row are a stuck sensor, 0 for off */
+} anomaly_options_t;
+
+/* what the anomaly detector remembers of a sensor, no readings are kept */
+typedef struct {
+   sensor_value_t mean;         /**< exponentially weighted moving average */
+   sensor_value_t variance;     /**< exponentially weighted moving variance */
+   sensor_value_t previous;     /**< the latest reading */
+   uint32_t count;              /**< readings seen, up to ANOMALY_WARMUP */
+   uint32_t repeats;            /**< readings in a row equal to 'previous' */
+   time_t last_logged;          /**< reading time of the latest anomaly logged, 0 if none */
+} anomaly_state_t;
+
+/* where a sensor or room stands against its limits, only changes of it are logged */
+typedef struct {
+   int8_t level;                /**< ALERT_LEVEL_NORMAL, ALERT_LEVEL_TOO_HOT or ALERT_LEVEL_TOO_COLD */
+   bool announced;              /**< the current alert has been logged */
+   time_t last_alert;           /**< reading time of the latest alert logged, 0 if none */
+} alert_state_t;
+
+typedef enum {
+   CONNMGR_MODE_THREADS,    /**< one blocking thread per sensor connection */
+   CONNMGR_MODE_EPOLL,      /**< a few I/O threads multiplex all connections with epoll */
+   CONNMGR_MODE_URING       /**< one thread accepts and reads all connections with io_uring, epoll if unavailable */
+} connmgr_mode_t;
 
 typedef struct connmgrParam {
    int max_con;
    int port;
-   sbuffer_t* sBuffer;
+   sbuffer_shards_t* sBuffers;
+   connmgr_mode_t mode;
+   int io_threads;          /**< number of I/O threads in CONNMGR_MODE_EPOLL, split over the listeners */
+   bool long_running;       /**< keep accepting until shutdown, max_con caps concurrent connections only */
+   int listeners;           /**< number of SO_REUSEPORT sockets, each with its own accept loop */
+   bool listener_shards;    /**< listener i inserts into shard i % shards instead of routing by sensor id */
+   int udp_port;            /**< also ingest UDP datagrams on this port, 0 to disable */
 } connection_manager_arguments_t;
 
+typedef struct {
+   int port;
+   sbuffer_shards_t *sBuffers;
+   atomic_bool stop;        /**< set by the connection manager before it inserts the end marker */
+} udp_manager_arguments_t;
+
 typedef struct {
    tcpsock_t *client;
-   sbuffer_t *sBuffer;
+   sbuffer_shards_t *sBuffers;
    int conn_id;
+   struct client_slots *slots;  /**< pool this argument slot is returned to when the connection ends, may be NULL */
 } client_thread_arguments_t;
 
 typedef struct {
    sbuffer_t *sBuffer;
+   int stage_id;
+   int window;              /**< readings in the running average of every sensor */
+   int worker;              /**< the partition of sensor ids this worker owns, 0 to workers - 1 */
+   int workers;             /**< data manager workers per shard, each reading its own partition buffer */
+   int shard;               /**< the shared buffer the worker reads, 0 to shards - 1 */
+   int shards;
+   bool any_shard;          /**< the listeners feed shards of their own, a sensor's readings may reach any shard */
+   alert_options_t alerts;
+   anomaly_options_t anomalies;
 } datamanager_arguments_t;
 
 typedef struct {
     sbuffer_t *sBuffer;
+    int stage_id;
 } storagemanager_arguments_t;
 
+typedef struct {
+   sbuffer_t *sBuffer;
+   int stage_id;
+   int resolutions[ROLLUP_MAX_RESOLUTIONS];   /**< window lengths in seconds */
+   int resolution_count;
+   FILE *files[ROLLUP_MAX_RESOLUTIONS];       /**< opened by rollup_open_files, closed by the stage */
+} rollup_arguments_t;
+
+typedef struct {
+   atomic_bool stop;        /**< set by main once the data managers have stopped */
+} map_watcher_arguments_t;
+
 typedef struct {
    sensor_id_t sensor_id;
    uint16_t room_id;
-   double running_avg[RUN_AVG_LENGTH];
-   int current_index;
+   sensor_value_t *window;      /**< ring of the latest readings, allocated at the first reading */
+   struct histogram *histogram; /**< of all readings, for the quantiles, allocated at the first reading */
+   sensor_value_t running_sum;  /**< sum of the readings in the window */
+   int count;                   /**< readings in the window, up to the window length */
+   int current_index;           /**< where the next reading goes */
    time_t last_modified;
+   sensor_value_t min_temp;     /**< limits of the running average, from LIMITS_FILE */
+   sensor_value_t max_temp;
+   alert_state_t alert;
+   anomaly_state_t anomaly;
+   struct room *room;           /**< the room the average counts in, NULL if it could not join it */
+   int member;                  /**< the sensor's slot in the room */
 } sensor_data_element_t;
 
 /* Function Declarations that are used in main*/
@@ -104,6 +252,26 @@ int create_log_process();
  */
 int end_log_process();
 
+/**
+ * Asks all components to stop, called from the SIGINT/SIGTERM handler
+ */
+void request_shutdown();
+
+/**
+ * @return true once the gateway has been asked to stop
+ */
+bool shutdown_requested();
+
+/**
+ * Asks the map watcher to reload the room map, called from the SIGHUP handler
+ */
+void request_map_reload();
+
+/**
+ * @return true if a reload was asked for since the last call
+ */
+bool map_reload_requested();
+
 /**
 * functions to count threads
 */
@@ -1,6 +1,8 @@
 //
 // Created by sodir on 12/9/24.
 //
+#define _GNU_SOURCE
+
 #include "connmgr.h"
 #include <pthread.h>
 #include <stdbool.h>
@@ -9,104 +11,1018 @@
 #include <stdlib.h>
 #include "sbuffer.h"
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <stdatomic.h>
+#include "lib/tcpuring.h"
+#include "udpmgr.h"
+#include "timerwheel.h"
+
+#define STREAM_PROTOCOL_ERROR (-1)  // not a tcp error: the sensor node broke the wire protocol
+
+/**
+ * what we know about the byte stream of one sensor node
+ */
+typedef struct stream {
+    int version;                    /**< wire protocol version, 0 until the first bytes arrived */
+    sensor_id_t sensor_id;          /**< 0 until the node identified itself (v2 handshake or first v1 reading) */
+    uint64_t readings;              /**< readings taken from the stream so far */
+} stream_t;
+
+/**
+ * idle and whole-frame timeout of one connection, only checked when its timer fires,
+ * so receiving costs no timer updates and no system calls
+ */
+typedef struct deadline {
+    timer_entry_t timer;
+    _Atomic uint64_t last_activity;     /**< ms of the last receive */
+    _Atomic uint64_t frame_started;     /**< ms at which the oldest incomplete reading or frame started, 0 if none */
+    _Atomic uint64_t scheduled;         /**< ms at which the timer fires */
+    uint64_t frame_readings;            /**< readings the stream had taken at frame_started */
+    atomic_bool throttled;              /**< the connection waits for a full buffer, it is not idle */
+    atomic_bool expired;                /**< the timer ended the connection */
+} deadline_t;
+
+/**
+ * max_con bookkeeping shared by all listeners of the connection manager
+ */
+typedef struct admission {
+    atomic_int accepted;            /**< connections admitted so far */
+    atomic_int active;              /**< connections open right now */
+    int max_con;
+    bool long_running;
+} admission_t;
+
+/**
+ * one listening socket with its own accept loop, running the configured connection mode
+ */
+typedef struct listener {
+    pthread_t thread;
+    tcpsock_t *server;
+    connection_manager_arguments_t *params;
+    sbuffer_shards_t *sBuffers;     /**< all shards, or a view of the listener's own shard */
+    int io_threads;                 /**< this listener's share of the epoll I/O threads */
+    admission_t *admission;
+} listener_t;
+
+/**
+ * state of one sensor connection in event loop mode
+ */
+typedef struct connection {
+    tcpsock_t *client;
+    int sd;
+    stream_t stream;
+    deadline_t deadline;
+    struct connection *prev;        /**< list of connections owned by one I/O thread */
+    struct connection *next;
+} connection_t;
+
+/**
+ * an I/O thread with its own epoll instance, serving a share of all connections
+ */
+typedef struct io_thread {
+    pthread_t thread;
+    int epfd;
+    int wakeup_fd;                  /**< eventfd, written when new connections are queued or on shutdown */
+    pthread_mutex_t queue_mutex;
+    connection_t *queue;            /**< accepted connections not yet picked up by the thread */
+    connection_t *connections;      /**< connections owned by the thread */
+    timer_wheel_t *timers;          /**< deadlines of the connections owned by the thread */
+    uint64_t now;                   /**< ms at the latest epoll_wait return, on a clock that skips stalled_ms */
+    uint64_t stalled_ms;            /**< time spent waiting for a full buffer, no connection idles meanwhile */
+    struct event_loop *loop;
+} io_thread_t;
+
+typedef struct event_loop {
+    io_thread_t *threads;
+    int thread_count;
+    sbuffer_shards_t *sBuffers;
+    admission_t *admission;
+    pthread_mutex_t active_mutex;
+    pthread_cond_t all_closed;
+    int active_connections;         /**< connections of this event loop, admission counts those of all listeners */
+    atomic_bool stopping;
+} event_loop_t;
+
+/**
+ * fixed pool of client_thread_arguments_t, a slot is reused as soon as its connection ends
+ */
+typedef struct client_slots {
+    client_thread_arguments_t *args;
+    int *free_slots;                /**< stack of free slot indices */
+    int free_count;
+    int capacity;
+    admission_t *admission;
+    deadline_t *deadlines;          /**< deadline of every slot, indexed like args */
+    timer_wheel_t *timers;          /**< deadlines of all connections, advanced by the accept loop */
+    pthread_mutex_t mutex;          /**< also protects the timers */
+    pthread_cond_t all_free;
+} client_slots_t;
+
+/**
+ * state of the io_uring event loop of one listener
+ */
+typedef struct uring_loop {
+    listener_t *listener;
+    tcp_uring_t *ring;
+    timer_wheel_t *timers;
+    connection_t *connections;
+    int active;
+    uint64_t now;                   /**< ms at the latest wait return, on a clock that skips stalled_ms */
+    uint64_t stalled_ms;            /**< time spent waiting for a full buffer, no connection idles meanwhile */
+} uring_loop_t;
+
+static void run_thread_per_connection(listener_t *listener);
+static void run_event_loop(listener_t *listener);
+static void run_uring_loop(listener_t *listener);
+
+/**
+ * \return true while listeners should accept connections: always with -r, otherwise until max_con were served
+ */
+static bool admission_open(admission_t *admission) {
+    return admission->long_running || atomic_load(&admission->accepted) < admission->max_con;
+}
+
+/**
+ * Counts a new connection as active, unless max_con connections are active or were served already
+ * \return true if the connection may be served, admission_release must follow when it ends
+ */
+static bool admission_admit(admission_t *admission) {
+    int active = atomic_load(&admission->active);
+    do {
+        if (active >= admission->max_con) return false;
+    } while (!atomic_compare_exchange_weak(&admission->active, &active, active + 1));
+
+    if (atomic_fetch_add(&admission->accepted, 1) >= admission->max_con && !admission->long_running) {
+        atomic_fetch_sub(&admission->active, 1);
+        return false;
+    }
+    return true;
+}
+
+static void admission_release(admission_t *admission) {
+    atomic_fetch_sub(&admission->active, 1);
+}
+
+/**
+ * Starts the timeouts of a new connection, the idle timeout fires TIMEOUT seconds after 'now' unless it receives something
+ */
+static void deadline_start(deadline_t *deadline, timer_wheel_t *timers, uint64_t now) {
+    timer_entry_init(&deadline->timer);
+    atomic_init(&deadline->last_activity, now);
+    atomic_init(&deadline->frame_started, 0);
+    atomic_init(&deadline->scheduled, now + TIMEOUT * 1000);
+    atomic_init(&deadline->throttled, false);
+    atomic_init(&deadline->expired, false);
+    deadline->frame_readings = 0;
+    timer_wheel_schedule(timers, &deadline->timer, now + TIMEOUT * 1000);
+}
+
+/**
+ * Notes that a connection received bytes at 'now' and took what it could from its receive buffer
+ * The idle timeout moves lazily (see deadline_expired), the timer is only moved when a new incomplete
+ * frame must be complete before the timer fires, under 'lock' if the wheel is shared
+ */
+static void deadline_progress(deadline_t *deadline, timer_wheel_t *timers, pthread_mutex_t *lock,
+                              tcpsock_t *client, stream_t *stream, uint64_t now) {
+    atomic_store_explicit(&deadline->last_activity, now, memory_order_relaxed);
+    if (tcp_peek_buffer(client, 1) == NULL) {
+        atomic_store_explicit(&deadline->frame_started, 0, memory_order_relaxed);
+        return;
+    }
+    // still the same incomplete frame as before: its deadline stands
+    if (atomic_load_explicit(&deadline->frame_started, memory_order_relaxed) != 0 &&
+        deadline->frame_readings == stream->readings) return;
+
+    deadline->frame_readings = stream->readings;
+    atomic_store_explicit(&deadline->frame_started, now, memory_order_relaxed);
+    uint64_t frame_deadline = now + FRAME_TIMEOUT * 1000;
+    if (frame_deadline < atomic_load(&deadline->scheduled)) {
+        if (lock) pthread_mutex_lock(lock);
+        if (!atomic_load(&deadline->expired)) {
+            atomic_store(&deadline->scheduled, frame_deadline);
+            timer_wheel_schedule(timers, &deadline->timer, frame_deadline);
+        }
+        if (lock) pthread_mutex_unlock(lock);
+    }
+}
 
-sbuffer_t *sBuffer;
+/**
+ * Called when the timer of a connection fires at 'now'
+ * \return true if the connection idled for TIMEOUT seconds or spent FRAME_TIMEOUT seconds on one frame,
+ *         otherwise its timer was moved to the earliest of both deadlines
+ */
+static bool deadline_expired(deadline_t *deadline, timer_wheel_t *timers, uint64_t now) {
+    uint64_t next = atomic_load(&deadline->last_activity) + TIMEOUT * 1000;
+    uint64_t frame_started = atomic_load(&deadline->frame_started);
+    if (frame_started != 0 && frame_started + FRAME_TIMEOUT * 1000 < next) next = frame_started + FRAME_TIMEOUT * 1000;
+    if (atomic_load(&deadline->throttled)) next = now + TIMEOUT * 1000;
+
+    if (next <= now) {
+        atomic_store(&deadline->expired, true);
+        return true;
+    }
+    atomic_store(&deadline->scheduled, next);
+    timer_wheel_schedule(timers, &deadline->timer, next);
+    return false;
+}
+
+static int client_slots_init(client_slots_t *slots, int capacity, sbuffer_shards_t *buffers, admission_t *admission) {
+    slots->args = malloc(sizeof(client_thread_arguments_t) * capacity);
+    slots->free_slots = malloc(sizeof(int) * capacity);
+    slots->deadlines = calloc(capacity, sizeof(deadline_t));
+    slots->timers = NULL;
+    if (!slots->args || !slots->free_slots || !slots->deadlines ||
+        timer_wheel_init(&slots->timers, TIMER_TICK_MS, timer_now_ms()) != TIMER_SUCCESS) {
+        free(slots->args);
+        free(slots->free_slots);
+        free(slots->deadlines);
+        return -1;
+    }
+    for (int i = 0; i < capacity; i++) {
+        slots->args[i].client = NULL;
+        slots->args[i].sBuffers = buffers;
+        slots->args[i].conn_id = i;
+        slots->args[i].slots = slots;
+        slots->free_slots[i] = capacity - 1 - i;
+    }
+    slots->free_count = capacity;
+    slots->capacity = capacity;
+    slots->admission = admission;
+    pthread_mutex_init(&slots->mutex, NULL);
+    pthread_cond_init(&slots->all_free, NULL);
+    return 0;
+}
+
+static void client_slots_destroy(client_slots_t *slots) {
+    pthread_mutex_destroy(&slots->mutex);
+    pthread_cond_destroy(&slots->all_free);
+    timer_wheel_free(&slots->timers);
+    free(slots->args);
+    free(slots->free_slots);
+    free(slots->deadlines);
+}
+
+/**
+ * \return a free slot or NULL when max_con connections are active
+ */
+static client_thread_arguments_t *client_slots_acquire(client_slots_t *slots) {
+    client_thread_arguments_t *slot = NULL;
+    pthread_mutex_lock(&slots->mutex);
+    if (slots->free_count > 0) {
+        slot = &slots->args[slots->free_slots[--slots->free_count]];
+    }
+    pthread_mutex_unlock(&slots->mutex);
+    return slot;
+}
+
+/**
+ * Closes the slot's connection and makes the slot available for the next one
+ */
+static void client_slots_release(client_slots_t *slots, client_thread_arguments_t *slot) {
+    pthread_mutex_lock(&slots->mutex);
+    timer_wheel_cancel(slots->timers, &slots->deadlines[slot->conn_id].timer);
+    tcp_close(&slot->client);
+    // before the slot is free: once all slots are, the pool may be destroyed
+    admission_release(slots->admission);
+    slots->free_slots[slots->free_count++] = slot->conn_id;
+    if (slots->free_count == slots->capacity) pthread_cond_signal(&slots->all_free);
+    pthread_mutex_unlock(&slots->mutex);
+}
+
+/**
+ * Timer callback of a connection thread: an expired connection gets its socket shut down,
+ * which ends the blocking receive of its thread
+ */
+static void expire_client_slot(timer_entry_t *timer, void *arg) {
+    client_slots_t *slots = (client_slots_t*)arg;
+    deadline_t *deadline = timer_entry_owner(timer, deadline_t, timer);
+    if (!deadline_expired(deadline, slots->timers, timer_now_ms())) return;
+
+    int sd;
+    client_thread_arguments_t *slot = &slots->args[deadline - slots->deadlines];
+    if (slot->client && tcp_get_sd(slot->client, &sd) == TCP_NO_ERROR) shutdown(sd, SHUT_RDWR);
+}
+
+/**
+ * Fires the timeouts of the connection threads that are due, called by the accept loop at least every ACCEPT_POLL_MS
+ */
+static void client_slots_expire(client_slots_t *slots) {
+    pthread_mutex_lock(&slots->mutex);
+    timer_wheel_advance(slots->timers, timer_now_ms(), expire_client_slot, slots, NULL);
+    pthread_mutex_unlock(&slots->mutex);
+}
+
+/**
+ * Waits until every connection has ended, expiring idle ones meanwhile
+ * \param interrupt if true, the sockets of active connections are shut down first so their threads stop reading
+ */
+static void client_slots_wait_all_free(client_slots_t *slots, bool interrupt) {
+    pthread_mutex_lock(&slots->mutex);
+    if (interrupt) {
+        for (int i = 0; i < slots->capacity; i++) {
+            int sd;
+            if (slots->args[i].client && tcp_get_sd(slots->args[i].client, &sd) == TCP_NO_ERROR) {
+                shutdown(sd, SHUT_RD);
+            }
+        }
+    }
+    while (slots->free_count < slots->capacity) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += ACCEPT_POLL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&slots->all_free, &slots->mutex, &deadline);
+        timer_wheel_advance(slots->timers, timer_now_ms(), expire_client_slot, slots, NULL);
+    }
+    pthread_mutex_unlock(&slots->mutex);
+}
+
+/**
+ * Remembers which sensor node is on the other side of 'stream' and logs the new connection
+ */
+static void stream_identified(stream_t *stream, sensor_id_t sensor_id) {
+    char log_message[LOG_MSG_MAX_LEN];
+    stream->sensor_id = sensor_id;
+    snprintf(log_message, sizeof(log_message), "Sensor node %d has opened a new connection", sensor_id);
+    write_to_log_process(log_message);
+}
+
+/**
+ * Decides from the first bytes whether the node speaks v1 or v2, and answers a v2 handshake
+ * with the highest version both sides know
+ * \return TCP_NO_ERROR when decided or more bytes are needed, STREAM_PROTOCOL_ERROR or the tcp error of the reply otherwise
+ */
+static int negotiate_version(tcpsock_t *client, stream_t *stream) {
+    uint8_t *start = tcp_peek_buffer(client, sizeof(sensor_id_t));
+    if (start == NULL) return TCP_NO_ERROR;
+    sensor_id_t first;
+    memcpy(&first, start, sizeof(first));
+    if (first != 0) {  // a v1 stream starts with a sensor id, never with the end marker
+        stream->version = 1;
+        return TCP_NO_ERROR;
+    }
+
+    uint8_t *handshake = tcp_peek_buffer(client, HANDSHAKE_SIZE);
+    if (handshake == NULL) return TCP_NO_ERROR;
+    uint16_t fields[4];  // <0><magic><version><sensor_id>
+    memcpy(fields, handshake, HANDSHAKE_SIZE);
+    tcp_consume_buffer(client, HANDSHAKE_SIZE);
+    if (fields[1] != PROTOCOL_MAGIC || fields[2] < 2 || fields[3] == 0) return STREAM_PROTOCOL_ERROR;
+
+    stream->version = (fields[2] < PROTOCOL_VERSION) ? fields[2] : PROTOCOL_VERSION;
+    stream_identified(stream, fields[3]);
+    uint16_t reply[2] = {PROTOCOL_MAGIC, stream->version};
+    int bytes = HANDSHAKE_REPLY_SIZE;
+    return tcp_send(client, reply, &bytes);
+}
+
+/**
+ * Unpacks the complete readings in the receive buffer of 'client', at most 'max' of them
+ * An incomplete reading or frame stays buffered until the rest of it arrives, a v2 frame
+ * that does not fit in 'out' anymore is left for the next call. An invalid v1 reading or v2 frame header is left
+ * buffered as well and only rejected once nothing was unpacked before it, so the valid readings go in first
+ * \param count a pointer to an int that will hold the number of readings written to 'out'
+ * \return TCP_NO_ERROR, STREAM_PROTOCOL_ERROR or the tcp error of the handshake reply
+ */
+static int take_records(tcpsock_t *client, stream_t *stream, sensor_data_t *out, int max, int *count) {
+    *count = 0;
+    if (stream->version == 0) {
+        int result = negotiate_version(client, stream);
+        if (result != TCP_NO_ERROR || stream->version == 0) return result;
+    }
+
+    uint8_t *record;
+    if (stream->version == 1) {
+        while (*count < max && (record = tcp_peek_buffer(client, RECORD_SIZE)) != NULL) {
+            sensor_id_t id;
+            memcpy(&id, record, sizeof(id));
+            if (id == 0) {
+                // would be taken for the end marker: the readings before it go in first, the next call rejects it
+                return (*count > 0) ? TCP_NO_ERROR : STREAM_PROTOCOL_ERROR;
+            }
+            sensor_data_t *data = &out[(*count)++];
+            data->id = id;
+            memcpy(&data->value, record + sizeof(data->id), sizeof(data->value));
+            memcpy(&data->ts, record + sizeof(data->id) + sizeof(data->value), sizeof(data->ts));
+            tcp_consume_buffer(client, RECORD_SIZE);
+            stream->readings++;
+            if (stream->sensor_id == 0) stream_identified(stream, data->id);
+        }
+        return TCP_NO_ERROR;
+    }
+
+    while ((record = tcp_peek_buffer(client, FRAME_HEADER_SIZE)) != NULL) {
+        uint16_t readings;
+        memcpy(&readings, record, sizeof(readings));
+        if (readings == 0 || readings > PROTOCOL_MAX_READINGS) return (*count > 0) ? TCP_NO_ERROR : STREAM_PROTOCOL_ERROR;
+        if (readings > max - *count) break;
+        record = tcp_peek_buffer(client, FRAME_HEADER_SIZE + readings * FRAME_READING_SIZE);
+        if (record == NULL) break;
+        record += FRAME_HEADER_SIZE;
+        for (int i = 0; i < readings; i++, record += FRAME_READING_SIZE) {
+            sensor_data_t *data = &out[(*count)++];
+            data->id = stream->sensor_id;
+            memcpy(&data->value, record, sizeof(data->value));
+            memcpy(&data->ts, record + sizeof(data->value), sizeof(data->ts));
+        }
+        tcp_consume_buffer(client, FRAME_HEADER_SIZE + readings * FRAME_READING_SIZE);
+        stream->readings += readings;
+    }
+    return TCP_NO_ERROR;
+}
+
+/**
+ * Inserts all complete readings buffered for 'client' into the shared buffers, one lock per batch
+ * \return TCP_NO_ERROR, STREAM_PROTOCOL_ERROR or the tcp error of the handshake reply
+ */
+static int insert_records(tcpsock_t *client, stream_t *stream, sbuffer_shards_t *sBuffers) {
+    sensor_data_t batch[SBUFFER_BATCH_SIZE];
+    int count;
+    int result;
+    while ((result = take_records(client, stream, batch, SBUFFER_BATCH_SIZE, &count)) == TCP_NO_ERROR && count > 0) {
+        sbuffer_shards_insert_batch(sBuffers, batch, count);
+    }
+    return result;
+}
+
+static void log_connection_end(sensor_id_t sensor_id, int result) {
+    char log_message[LOG_MSG_MAX_LEN];
+    if (sensor_id == 0) return;  // Only log if we had a valid sensor
+
+    if (result == TCP_NO_ERROR) {
+        snprintf(log_message, sizeof(log_message), "Sensor node %d disconnected, the gateway is shutting down", sensor_id);
+    } else if (result == TCP_TIMEOUT_ERROR) {
+        snprintf(log_message, sizeof(log_message), "Sensor node %d has timed out", sensor_id);
+    } else if (result == TCP_CONNECTION_CLOSED) {
+        snprintf(log_message, sizeof(log_message), "Sensor node %d has closed the connection", sensor_id);
+    } else if (result == STREAM_PROTOCOL_ERROR) {
+        snprintf(log_message, sizeof(log_message), "Sensor node %d sent an invalid frame", sensor_id);
+    } else {
+        snprintf(log_message, sizeof(log_message), "Sensor node %d encountered a socket error", sensor_id);
+    }
+    write_to_log_process(log_message);
+}
+
+/**
+ * Thread function of one listener, runs the configured connection mode on its own socket
+ */
+static void *serve_listener(void *args) {
+    listener_t *listener = (listener_t*)args;
+    if (listener->params->mode == CONNMGR_MODE_EPOLL) {
+        run_event_loop(listener);
+    } else if (listener->params->mode == CONNMGR_MODE_URING) {
+        run_uring_loop(listener);
+    } else {
+        run_thread_per_connection(listener);
+    }
+    return NULL;
+}
 
 void *connection_manager(void *args) {
     connection_manager_arguments_t *params = (connection_manager_arguments_t*)args; //use of explicit casting is safer
-    tcpsock_t *server = NULL;
-    int active_connections = 0;
+    int count = (params->listeners > 1) ? params->listeners : 1;
+    listener_t *listeners = calloc(count, sizeof(listener_t));
+    admission_t admission = {.max_con = params->max_con, .long_running = params->long_running};
+    int opened = 0;
+    atomic_init(&admission.accepted, 0);
+    atomic_init(&admission.active, 0);
 
     write_to_log_process("Connection manager started");
 
-    if (tcp_passive_open(&server, params->port) != TCP_NO_ERROR) {
+    // the UDP listener runs as long as the TCP listeners, it must be stopped before the end marker goes in
+    udp_manager_arguments_t udp_params = {.port = params->udp_port, .sBuffers = params->sBuffers};
+    pthread_t udp_thread;
+    atomic_init(&udp_params.stop, false);
+    bool udp_started = params->udp_port > 0 && pthread_create(&udp_thread, NULL, udp_manager, &udp_params) == 0;
+    if (params->udp_port > 0 && !udp_started) write_to_log_process("Failed to start UDP listener thread");
+
+    // several listeners each get their own SO_REUSEPORT socket, the kernel spreads new connections over them
+    for (int i = 0; listeners != NULL && i < count; i++) {
+        listener_t *listener = &listeners[i];
+        int result = (count > 1) ? tcp_passive_open_shared(&listener->server, params->port)
+                                 : tcp_passive_open(&listener->server, params->port);
+        if (result != TCP_NO_ERROR) break;
+        listener->params = params;
+        listener->admission = &admission;
+        listener->io_threads = (params->io_threads > count) ? params->io_threads / count : 1;
+        listener->sBuffers = params->sBuffers;
+        if (params->listener_shards && sbuffer_shards_view(&listener->sBuffers, params->sBuffers,
+                                                           i % sbuffer_shards_count(params->sBuffers)) != SBUFFER_SUCCESS) {
+            tcp_close(&listener->server);
+            break;
+        }
+        opened++;
+    }
+
+    if (opened < count) {
         write_to_log_process("Failed to open server socket");
-        return NULL;
+    } else if (count == 1) {
+        serve_listener(&listeners[0]);
+    } else {
+        char log_message[LOG_MSG_MAX_LEN];
+        snprintf(log_message, sizeof(log_message), "Connection manager accepting on %d listeners%s", count,
+                 params->listener_shards ? ", each with its own shared buffer" : "");
+        write_to_log_process(log_message);
+
+        int started = 0;
+        while (started < count && pthread_create(&listeners[started].thread, NULL, serve_listener, &listeners[started]) == 0) {
+            started++;
+        }
+        if (started < count) write_to_log_process("Failed to start listener thread");
+        for (int i = 0; i < started; i++) {
+            pthread_join(listeners[i].thread, NULL);
+        }
+    }
+
+    if (udp_started) {
+        atomic_store(&udp_params.stop, true);
+        pthread_join(udp_thread, NULL);
+    }
+
+    //inserting end marker in every shared buffer, also when we could not listen, so the other stages stop
+    sensor_data_t end_marker = {.id = 0};
+    sbuffer_shards_insert(params->sBuffers, &end_marker);
+
+    for (int i = 0; i < opened; i++) {
+        tcp_close(&listeners[i].server);
+        if (listeners[i].sBuffers != params->sBuffers) sbuffer_shards_free(&listeners[i].sBuffers);
     }
+    free(listeners);
+    write_to_log_process("Connection manager shutting down");
+    return NULL;
+}
 
-    pthread_t *client_threads = malloc(sizeof(pthread_t) * params->max_con); //correcte aantal opstarten
-    client_thread_arguments_t *thread_args = malloc(sizeof(client_thread_arguments_t) * params->max_con);
+/**
+ * Accepts a connection, or gives up after ACCEPT_POLL_MS so the caller can check for a shutdown request
+ */
+static int accept_connection(tcpsock_t *server, tcpsock_t **client) {
+    return tcp_wait_for_connection_timeout(server, client, ACCEPT_POLL_MS);
+}
+
+/**
+ * Closes a connection that would exceed max_con right away, instead of leaving it in the listen backlog
+ */
+static void reject_connection(tcpsock_t **client, int max_con) {
+    char log_message[LOG_MSG_MAX_LEN];
+    snprintf(log_message, sizeof(log_message), "Rejected a connection: %d sensor nodes are already connected", max_con);
+    write_to_log_process(log_message);
+    tcp_close(client);
+}
 
-    while (active_connections < params->max_con) {
-        thread_args[active_connections].sBuffer = params->sBuffer;
-        thread_args[active_connections].conn_id = active_connections;
+static void run_thread_per_connection(listener_t *listener) {
+    connection_manager_arguments_t *params = listener->params;
+    client_slots_t slots;
+    if (client_slots_init(&slots, params->max_con, listener->sBuffers, listener->admission) != 0) {
+        write_to_log_process("Failed to allocate client threads");
+        return;
+    }
+
+    while (!shutdown_requested() && admission_open(listener->admission)) {
+        tcpsock_t *client = NULL;
+        int accepted = accept_connection(listener->server, &client);
+        client_slots_expire(&slots);
+        if (accepted != TCP_NO_ERROR) {
+            continue;
+        }
 
-        //if we have no errors
-        if (tcp_wait_for_connection(server, &(thread_args[active_connections].client)) != TCP_NO_ERROR) {
+        if (!admission_admit(listener->admission)) {
+            reject_connection(&client, params->max_con);
             continue;
         }
+        // admitted connections never exceed max_con, so there always is a free slot
+        client_thread_arguments_t *thread_args = client_slots_acquire(&slots);
+        thread_args->client = client;
 
-        // Create thread for new client
-        if (pthread_create(&client_threads[active_connections], NULL, connect_connmmgr, &thread_args[active_connections]) != 0) {
+        // Create a detached thread for the new client, it returns its slot when the connection ends
+        pthread_t client_thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int result = pthread_create(&client_thread, &attr, connect_connmmgr, thread_args);
+        pthread_attr_destroy(&attr);
+        if (result != 0) {
             write_to_log_process("Failed to create client thread");
-            tcp_close(&thread_args[active_connections].client);
+            client_slots_release(&slots, thread_args);
             continue;
         }
+    }
+
+    //finishing all threads, on a shutdown request their sockets are shut down so they stop right away
+    client_slots_wait_all_free(&slots, shutdown_requested());
+    client_slots_destroy(&slots);
+}
 
-        active_connections++;
+/**
+ * Closes a connection owned by 'io' and wakes up the acceptor when it was the last one
+ * \param result the tcp error that ended the connection, TCP_NO_ERROR if the gateway closes it
+ */
+static void close_connection(io_thread_t *io, connection_t *conn, int result) {
+    log_connection_end(conn->stream.sensor_id, result);
+
+    timer_wheel_cancel(io->timers, &conn->deadline.timer);
+    epoll_ctl(io->epfd, EPOLL_CTL_DEL, conn->sd, NULL);
+    if (conn->prev) conn->prev->next = conn->next;
+    else io->connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    tcp_close(&conn->client);
+    free(conn);
+
+    event_loop_t *loop = io->loop;
+    admission_release(loop->admission);
+    pthread_mutex_lock(&loop->active_mutex);
+    if (--loop->active_connections == 0) pthread_cond_signal(&loop->all_closed);
+    pthread_mutex_unlock(&loop->active_mutex);
+}
+
+/**
+ * Reads everything the socket has queued (edge triggered), turns it into readings and inserts them
+ * \return TCP_NO_ERROR while the connection stays open, the tcp error that ended it otherwise
+ */
+static int handle_readable(io_thread_t *io, connection_t *conn) {
+    while (1) {
+        int bytes;
+        int result = tcp_fill_buffer(conn->client, &bytes);
+        if (result == TCP_WOULD_BLOCK) return TCP_NO_ERROR;
+        if (result != TCP_NO_ERROR) return result;
+
+        result = insert_records(conn->client, &conn->stream, io->loop->sBuffers);
+        if (result != TCP_NO_ERROR) return result;
+        deadline_progress(&conn->deadline, io->timers, NULL, conn->client, &conn->stream, io->now);
+
+        // stop reading while our buffer is overloaded, TCP flow control then slows the sensor nodes down
+        if (conn->stream.sensor_id != 0) {
+            uint64_t stalled = timer_now_ms();
+            sbuffer_wait_below_watermark(sbuffer_shard_for(io->loop->sBuffers, conn->stream.sensor_id));
+            io->stalled_ms += timer_now_ms() - stalled;
+        }
     }
+}
 
-    //finishing all threads
-    for (int i = 0; i < active_connections; i++) {
-        pthread_join(client_threads[i], NULL);
+/**
+ * Moves the connections queued by the acceptor into this thread's epoll set
+ */
+static void adopt_new_connections(io_thread_t *io) {
+    pthread_mutex_lock(&io->queue_mutex);
+    connection_t *conn = io->queue;
+    io->queue = NULL;
+    pthread_mutex_unlock(&io->queue_mutex);
+
+    while (conn) {
+        connection_t *next = conn->next;
+        struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = conn};
+
+        conn->prev = NULL;
+        conn->next = io->connections;
+        if (io->connections) io->connections->prev = conn;
+        io->connections = conn;
+        deadline_start(&conn->deadline, io->timers, io->now);
+
+        if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, conn->sd, &event) != 0) {
+            write_to_log_process("Failed to add connection to epoll");
+            close_connection(io, conn, TCP_SOCKOP_ERROR);
+        } else {
+            // data may have arrived before the socket was added, edge triggered epoll would not report it
+            int result = handle_readable(io, conn);
+            if (result != TCP_NO_ERROR) close_connection(io, conn, result);
+        }
+        conn = next;
     }
+}
 
-    //inserting end marker in shared buffer
-    sensor_data_t end_marker = {.id = 0};
-    sbuffer_insert(params->sBuffer, &end_marker);
+static void wake_io_thread(io_thread_t *io) {
+    uint64_t one = 1;
+    if (write(io->wakeup_fd, &one, sizeof(one)) < 0) {
+        write_to_log_process("Failed to wake up I/O thread");
+    }
+}
 
-    free(client_threads);
-    free(thread_args);
-    tcp_close(&server);
-    write_to_log_process("Connection manager shutting down");
+/**
+ * Timer callback of an I/O thread, closes the connection if it timed out
+ */
+static void expire_connection(timer_entry_t *timer, void *arg) {
+    io_thread_t *io = (io_thread_t*)arg;
+    connection_t *conn = timer_entry_owner(timer, connection_t, deadline.timer);
+    if (deadline_expired(&conn->deadline, io->timers, io->now)) close_connection(io, conn, TCP_TIMEOUT_ERROR);
+}
+
+static void *io_thread_main(void *args) {
+    io_thread_t *io = (io_thread_t*)args;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    while (!io->loop->stopping) {
+        int ready = epoll_wait(io->epfd, events, EPOLL_MAX_EVENTS, 1000);
+        io->now = timer_now_ms() - io->stalled_ms;
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) {
+                uint64_t value;
+                while (read(io->wakeup_fd, &value, sizeof(value)) > 0) {}  // reset the eventfd counter
+                adopt_new_connections(io);
+                continue;
+            }
+            connection_t *conn = (connection_t*)events[i].data.ptr;
+            int result = TCP_NO_ERROR;
+            if (events[i].events & EPOLLIN) result = handle_readable(io, conn);
+            if (result == TCP_NO_ERROR && (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                result = (events[i].events & EPOLLERR) ? TCP_SOCKOP_ERROR : TCP_CONNECTION_CLOSED;
+            }
+            if (result != TCP_NO_ERROR) close_connection(io, conn, result);
+        }
+        timer_wheel_advance(io->timers, io->now, expire_connection, io, NULL);
+    }
+
+    //gateway shutdown: drop whatever is still connected
+    adopt_new_connections(io);
+    while (io->connections) {
+        close_connection(io, io->connections, TCP_NO_ERROR);
+    }
     return NULL;
 }
 
+static void run_event_loop(listener_t *listener) {
+    connection_manager_arguments_t *params = listener->params;
+    event_loop_t loop = {.thread_count = 0, .sBuffers = listener->sBuffers, .admission = listener->admission,
+                         .active_connections = 0, .stopping = false};
+    pthread_mutex_init(&loop.active_mutex, NULL);
+    pthread_cond_init(&loop.all_closed, NULL);
+
+    loop.threads = calloc(listener->io_threads, sizeof(io_thread_t));
+    if (!loop.threads) {
+        write_to_log_process("Failed to allocate I/O threads");
+        return;
+    }
+
+    for (int i = 0; i < listener->io_threads; i++) {
+        io_thread_t *io = &loop.threads[i];
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+        io->loop = &loop;
+        io->epfd = epoll_create1(0);
+        io->wakeup_fd = eventfd(0, EFD_NONBLOCK);
+        io->now = timer_now_ms();
+        pthread_mutex_init(&io->queue_mutex, NULL);
+        if (io->epfd < 0 || io->wakeup_fd < 0 || epoll_ctl(io->epfd, EPOLL_CTL_ADD, io->wakeup_fd, &event) != 0 ||
+            timer_wheel_init(&io->timers, TIMER_TICK_MS, io->now) != TIMER_SUCCESS ||
+            pthread_create(&io->thread, NULL, io_thread_main, io) != 0) {
+            write_to_log_process("Failed to start I/O thread");
+            if (io->epfd >= 0) close(io->epfd);
+            if (io->wakeup_fd >= 0) close(io->wakeup_fd);
+            if (io->timers) timer_wheel_free(&io->timers);
+            pthread_mutex_destroy(&io->queue_mutex);
+            break;
+        }
+        loop.thread_count++;
+    }
+
+    char log_message[LOG_MSG_MAX_LEN];
+    snprintf(log_message, sizeof(log_message), "Connection manager serving connections with %d epoll I/O thread(s)", loop.thread_count);
+    write_to_log_process(log_message);
+
+    int accepted = 0;
+    while (loop.thread_count > 0 && !shutdown_requested() && admission_open(listener->admission)) {
+        tcpsock_t *client = NULL;
+        if (accept_connection(listener->server, &client) != TCP_NO_ERROR) continue;
+
+        if (!admission_admit(listener->admission)) {
+            reject_connection(&client, params->max_con);
+            continue;
+        }
+
+        connection_t *conn = malloc(sizeof(connection_t));
+        if (!conn || tcp_set_nonblocking(client) != TCP_NO_ERROR) {
+            write_to_log_process("Failed to set up sensor connection");
+            free(conn);
+            tcp_close(&client);
+            admission_release(listener->admission);
+            continue;
+        }
+        conn->client = client;
+        tcp_get_sd(client, &conn->sd);
+        conn->stream.version = 0;
+        conn->stream.sensor_id = 0;
+        conn->stream.readings = 0;
+
+        pthread_mutex_lock(&loop.active_mutex);
+        loop.active_connections++;
+        pthread_mutex_unlock(&loop.active_mutex);
+
+        //round robin over the I/O threads
+        io_thread_t *io = &loop.threads[accepted % loop.thread_count];
+        pthread_mutex_lock(&io->queue_mutex);
+        conn->next = io->queue;
+        io->queue = conn;
+        pthread_mutex_unlock(&io->queue_mutex);
+        wake_io_thread(io);
+
+        accepted++;
+    }
+
+    //wait until every sensor node is gone (or a shutdown is requested), then stop the I/O threads
+    pthread_mutex_lock(&loop.active_mutex);
+    while (loop.active_connections > 0 && !shutdown_requested()) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += ACCEPT_POLL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&loop.all_closed, &loop.active_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&loop.active_mutex);
+
+    loop.stopping = true;
+    for (int i = 0; i < loop.thread_count; i++) {
+        wake_io_thread(&loop.threads[i]);
+        pthread_join(loop.threads[i].thread, NULL);
+        close(loop.threads[i].epfd);
+        close(loop.threads[i].wakeup_fd);
+        timer_wheel_free(&loop.threads[i].timers);
+        pthread_mutex_destroy(&loop.threads[i].queue_mutex);
+    }
+
+    free(loop.threads);
+    pthread_mutex_destroy(&loop.active_mutex);
+    pthread_cond_destroy(&loop.all_closed);
+}
+
+/**
+ * Cancels the receive of a connection in io_uring mode, closes it and unlinks it from the loop
+ * \param result the tcp error that ended the connection, TCP_NO_ERROR if the gateway closes it
+ */
+static void close_uring_connection(uring_loop_t *loop, connection_t *conn, int result) {
+    log_connection_end(conn->stream.sensor_id, result);
+    admission_release(loop->listener->admission);
+    timer_wheel_cancel(loop->timers, &conn->deadline.timer);
+    tcp_uring_cancel(loop->ring, conn->client);
+    if (conn->prev) conn->prev->next = conn->next;
+    else loop->connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    tcp_close(&conn->client);
+    free(conn);
+    loop->active--;
+}
+
+/**
+ * Timer callback of the io_uring loop, closes the connection if it timed out
+ */
+static void expire_uring_connection(timer_entry_t *timer, void *arg) {
+    uring_loop_t *loop = (uring_loop_t*)arg;
+    connection_t *conn = timer_entry_owner(timer, connection_t, deadline.timer);
+    if (deadline_expired(&conn->deadline, loop->timers, loop->now)) close_uring_connection(loop, conn, TCP_TIMEOUT_ERROR);
+}
+
+static void run_uring_loop(listener_t *listener) {
+    connection_manager_arguments_t *params = listener->params;
+    tcpsock_t *server = listener->server;
+    uring_loop_t loop = {.listener = listener, .ring = NULL, .timers = NULL, .connections = NULL, .active = 0,
+                         .now = timer_now_ms(), .stalled_ms = 0};
+    if (tcp_uring_init(&loop.ring) != TCP_NO_ERROR || tcp_uring_accept(loop.ring, server, NULL) != TCP_NO_ERROR ||
+        timer_wheel_init(&loop.timers, TIMER_TICK_MS, loop.now) != TIMER_SUCCESS) {
+        write_to_log_process("io_uring is not available, falling back to epoll");
+        if (loop.ring) tcp_uring_free(&loop.ring);
+        run_event_loop(listener);
+        return;
+    }
+    write_to_log_process("Connection manager serving connections with io_uring");
+
+    tcp_uring_event_t events[EPOLL_MAX_EVENTS];
+    bool accepting = true;
+
+    while (!shutdown_requested() && (accepting || loop.active > 0)) {
+        // without -r we serve max_con sensor nodes (over all listeners) and then stop listening
+        if (accepting && !admission_open(listener->admission)) {
+            tcp_uring_cancel(loop.ring, server);
+            accepting = false;
+        }
+
+        int count;
+        if (tcp_uring_wait(loop.ring, events, EPOLL_MAX_EVENTS, ACCEPT_POLL_MS, &count) != TCP_NO_ERROR) {
+            write_to_log_process("Waiting for io_uring completions failed");
+            break;
+        }
+        loop.now = timer_now_ms() - loop.stalled_ms;
+
+        for (int i = 0; i < count; i++) {
+            tcp_uring_event_t *event = &events[i];
+            if (event->type == 0) continue;
+            if (event->type == TCP_URING_ACCEPT) {
+                if (event->result != TCP_NO_ERROR) {
+                    if (accepting) tcp_uring_accept(loop.ring, server, NULL);
+                    continue;
+                }
+                tcpsock_t *client = event->socket;
+                if (!accepting || !admission_admit(listener->admission)) {
+                    reject_connection(&client, params->max_con);
+                    continue;
+                }
+                connection_t *conn = malloc(sizeof(connection_t));
+                if (!conn || tcp_uring_receive(loop.ring, client, conn) != TCP_NO_ERROR) {
+                    write_to_log_process("Failed to set up sensor connection");
+                    free(conn);
+                    tcp_uring_cancel(loop.ring, client);
+                    tcp_close(&client);
+                    admission_release(listener->admission);
+                    continue;
+                }
+                conn->client = client;
+                tcp_get_sd(client, &conn->sd);
+                conn->stream.version = 0;
+                conn->stream.sensor_id = 0;
+                conn->stream.readings = 0;
+                deadline_start(&conn->deadline, loop.timers, loop.now);
+                conn->prev = NULL;
+                conn->next = loop.connections;
+                if (loop.connections) loop.connections->prev = conn;
+                loop.connections = conn;
+                loop.active++;
+                continue;
+            }
+
+            connection_t *conn = event->user_data;
+            int result = event->result;
+            if (result == TCP_NO_ERROR) {
+                result = insert_records(conn->client, &conn->stream, listener->sBuffers);
+            }
+            if (result != TCP_NO_ERROR) {
+                close_uring_connection(&loop, conn, result);
+                for (int j = i + 1; j < count; j++) {  // later events of this batch may still point at it
+                    if (events[j].user_data == conn) events[j].type = 0;
+                }
+                continue;
+            }
+            deadline_progress(&conn->deadline, loop.timers, NULL, conn->client, &conn->stream, loop.now);
+            if (conn->stream.sensor_id != 0) {
+                // stop reading while our buffer is overloaded, TCP flow control then slows the sensor nodes down
+                uint64_t stalled = timer_now_ms();
+                sbuffer_wait_below_watermark(sbuffer_shard_for(listener->sBuffers, conn->stream.sensor_id));
+                loop.stalled_ms += timer_now_ms() - stalled;
+            }
+        }
+
+        timer_wheel_advance(loop.timers, loop.now, expire_uring_connection, &loop, NULL);
+    }
+
+    while (loop.connections) {
+        close_uring_connection(&loop, loop.connections, TCP_NO_ERROR);
+    }
+    timer_wheel_free(&loop.timers);
+    tcp_uring_free(&loop.ring);
+}
+
 void *connect_connmmgr(void *args) {
     client_thread_arguments_t *client_arguments = (client_thread_arguments_t*)args;
-    sensor_data_t data;
+    client_slots_t *slots = client_arguments->slots;
+    stream_t stream = {.version = 0, .sensor_id = 0, .readings = 0};
+    deadline_t *deadline = NULL;
     int bytes;
-    bool first_msg = true;
 
-    while (1) {
-        char log_message[300];
-        // read sensor id, check if we are first, also check tcp error
-        bytes = sizeof(data.id);
-        int result = tcp_receive_with_timeout(client_arguments->client, &data.id, &bytes, TIMEOUT);
+    if (slots) {
+        // the accept loop expires the connection by shutting its socket down, receives block without a timeout
+        pthread_mutex_lock(&slots->mutex);
+        deadline = &slots->deadlines[client_arguments->conn_id];
+        deadline_start(deadline, slots->timers, timer_now_ms());
+        pthread_mutex_unlock(&slots->mutex);
+    } else {
+        tcp_set_receive_timeout(client_arguments->client, TIMEOUT);
+    }
 
-        if (first_msg && result == TCP_NO_ERROR) {
-          snprintf(log_message, sizeof(log_message), "Sensor node %d has opened a new connection", data.id);
-          write_to_log_process(log_message);
-          first_msg = false;
+    while (1) {
+        // receive whatever the node has sent so far, readings and frames can be split over several receives
+        int result = tcp_fill_buffer(client_arguments->client, &bytes);
+        if (result == TCP_NO_ERROR) {
+            result = insert_records(client_arguments->client, &stream, client_arguments->sBuffers);
         }
-
         if (result != TCP_NO_ERROR) {
-          if (!first_msg) {  // Only log if we had a valid sensor
-            if (result == TCP_TIMEOUT_ERROR) {
-                snprintf(log_message, sizeof(log_message), "Sensor node %d has timed out", data.id);
-            } else if (result == TCP_CONNECTION_CLOSED) {
-                snprintf(log_message, sizeof(log_message), "Sensor node %d has closed the connection", data.id);
-            } else if (result == TCP_SOCKET_ERROR) {
-                snprintf(log_message, sizeof(log_message), "Sensor node %d encountered a socket error", data.id);
-            } else {
-                snprintf(log_message, sizeof(log_message), "Sensor node %d encountered an error", data.id);
+            if (deadline && atomic_load(&deadline->expired)) result = TCP_TIMEOUT_ERROR;
+            log_connection_end(stream.sensor_id, result);
+            break;
+        }
+        if (deadline) {
+            deadline_progress(deadline, slots->timers, &slots->mutex, client_arguments->client, &stream, timer_now_ms());
+        }
+        // stop reading while our buffer is overloaded, TCP flow control then slows the sensor node down
+        if (stream.sensor_id != 0) {
+            if (deadline) atomic_store(&deadline->throttled, true);
+            sbuffer_wait_below_watermark(sbuffer_shard_for(client_arguments->sBuffers, stream.sensor_id));
+            if (deadline) {
+                // the node could not send while we did not read
+                uint64_t now = timer_now_ms();
+                atomic_store(&deadline->last_activity, now);
+                if (atomic_load(&deadline->frame_started) != 0) atomic_store(&deadline->frame_started, now);
+                atomic_store(&deadline->throttled, false);
             }
-            write_to_log_process(log_message);
-          }
-         break;
         }
-        //reading all other paramaters
-        bytes = sizeof(data.value);
-        if (tcp_receive_with_timeout(client_arguments->client, &data.value, &bytes, TIMEOUT) != TCP_NO_ERROR)
-            break;
-
-        bytes = sizeof(data.ts);
-        if (tcp_receive_with_timeout(client_arguments->client, &data.ts, &bytes, TIMEOUT) != TCP_NO_ERROR)
-            break;
-
-        //now we insert it in the buffer,
-        sbuffer_insert(client_arguments->sBuffer, &data);
     }
-    tcp_close(&client_arguments->client);
+    if (client_arguments->slots) {
+        client_slots_release(client_arguments->slots, client_arguments);
+    } else {
+        tcp_close(&client_arguments->client);
+    }
     return NULL;
 }
\ No newline at end of file
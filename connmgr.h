@@ -12,9 +12,15 @@
 
 /**
  * Main thread function for the connection manager
- * - Initializes the TCP server socket
+ * - Initializes the TCP server socket, or 'listeners' SO_REUSEPORT sockets that each run the mode below
+ *   on their own thread (optionally feeding their own shard), sharing one max_con limit
  * - Listens for incoming sensor connections
- * - Creates worker threads for each connected sensor
+ * - CONNMGR_MODE_THREADS: creates a worker thread for each connected sensor
+ * - CONNMGR_MODE_EPOLL: hands every connection to one of 'io_threads' event loop threads, which
+ *   read all their (non-blocking) sockets with edge-triggered epoll
+ * - CONNMGR_MODE_URING: accepts and reads all connections on its own thread with multishot io_uring
+ *   operations, falls back to CONNMGR_MODE_EPOLL when the kernel does not support them
+ * - With a udp_port, also runs the UDP listener (see udp_manager) until the TCP listeners stop
  * - Manages the lifecycle of sensor connections
  * @param args Pointer to connection manager parameters (connection_manager_arguments_t)
  * @return NULL on completion, all error handling done via logging
@@ -1,185 +1,1045 @@
 //
 // Created by sodir on 12/9/24.
 //
+#define _GNU_SOURCE
 
 #include "datamgr.h"
 #include "sbuffer.h"
 #include "config.h"
+#include <math.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 
 #define LINE_BUFFER_SIZE 12
+#define MAX_MAP_READERS (MAX_SHARDS * MAX_DATA_WORKERS)
+#define ROOM_RESUM_INTERVAL 4096    // updates after which a room recomputes its sum, so rounding errors do not pile up
 
-dplist_t *list;
+/* the published room map: replaced as a whole by datamgr_reload_map, read by the workers without a lock */
+static _Atomic(sensor_map_t *) current_map = NULL;
+static _Atomic uint64_t map_generation = 0;
+static _Atomic uint64_t map_readers[MAX_MAP_READERS];   /**< generation a worker is copying from, 0 if none */
+static atomic_int map_reader_count = 0;
+static pthread_mutex_t reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t initial_map_once = PTHREAD_ONCE_INIT;
+
+/* the latest state of every sensor for readers on other threads, one seqlock per sensor (see datamgr_get_snapshot)
+ * the fields are read while they are written, so they are atomics too, accessed relaxed: the fences order them */
+typedef struct snapshot_slot {
+    atomic_uint sequence;               /**< odd while a data manager writes the slot */
+    _Atomic uint64_t readings;
+    _Atomic sensor_value_t latest;
+    _Atomic sensor_value_t average;
+    atomic_bool window_full;
+    _Atomic time_t last_modified;
+    _Atomic uint64_t quantile_readings;
+    _Atomic sensor_value_t p50;
+    _Atomic sensor_value_t p95;
+    _Atomic sensor_value_t p99;
+} snapshot_slot_t;
+
+static snapshot_slot_t snapshots[SENSOR_ID_COUNT];
+static _Atomic uint32_t mapped_rooms[SENSOR_ID_COUNT];     /**< room id + 1 of every sensor in the current map, 0 if not mapped */
+static atomic_int mapped_sensors = 0;
+
+/**
+ * Publishes the state of 'sensor' after its reading 'value' to the readers of its snapshot
+ */
+static void snapshot_publish(sensor_table_t *table, sensor_data_element_t *sensor, sensor_value_t value) {
+    snapshot_slot_t *slot = &snapshots[sensor->sensor_id];
+
+    // three scans of the buckets: at every power of two readings, then every QUANTILE_REFRESH_INTERVAL of them
+    histogram_t *histogram = sensor->histogram;
+    uint64_t readings = histogram ? histogram->count : 0;
+    bool refresh = readings > 0 && ((readings & (readings - 1)) == 0 || readings % QUANTILE_REFRESH_INTERVAL == 0);
+    sensor_value_t p50 = 0, p95 = 0, p99 = 0;
+    if (refresh) {
+        p50 = histogram_quantile(histogram, 0.5);
+        p95 = histogram_quantile(histogram, 0.95);
+        p99 = histogram_quantile(histogram, 0.99);
+    }
+
+    // a sensor belongs to one data manager, but with -S the tables of every shard hold it and a node that
+    // reconnects through another listener feeds another shard: writers take the slot by making the sequence odd,
+    // so they never interleave. Each shard publishes the average and quantiles of the readings it got itself.
+    unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    while ((sequence & 1) || !atomic_compare_exchange_weak_explicit(&slot->sequence, &sequence, sequence + 1,
+                                                                     memory_order_acquire, memory_order_relaxed)) {
+        if (sequence & 1) sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_release);
+
+    uint64_t published = atomic_load_explicit(&slot->readings, memory_order_relaxed);
+    atomic_store_explicit(&slot->readings, published + 1, memory_order_relaxed);
+    atomic_store_explicit(&slot->latest, value, memory_order_relaxed);
+    atomic_store_explicit(&slot->average, sensor->running_sum / sensor->count, memory_order_relaxed);
+    atomic_store_explicit(&slot->window_full, sensor->count == table->window, memory_order_relaxed);
+    atomic_store_explicit(&slot->last_modified, sensor->last_modified, memory_order_relaxed);
+    if (refresh) {
+        atomic_store_explicit(&slot->quantile_readings, readings, memory_order_relaxed);
+        atomic_store_explicit(&slot->p50, p50, memory_order_relaxed);
+        atomic_store_explicit(&slot->p95, p95, memory_order_relaxed);
+        atomic_store_explicit(&slot->p99, p99, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+}
+
+/**
+ * Publishes the room of every sensor in 'map' to the readers of the snapshots, the caller holds the reload mutex
+ */
+static void publish_mapped_rooms(sensor_map_t *map) {
+    uint32_t *rooms_of_sensors = calloc(SENSOR_ID_COUNT, sizeof(uint32_t));
+    if (!rooms_of_sensors) {
+        write_to_log_process("Failed to publish the rooms of the sensor map");
+        return;
+    }
+    for (int i = 0; i < map->count; i++) {
+        rooms_of_sensors[map->mappings[i].sensor_id] = map->mappings[i].room_id + 1u;
+    }
+    int sensors = 0;
+    for (int id = 0; id < SENSOR_ID_COUNT; id++) {
+        if (rooms_of_sensors[id] != 0) sensors++;
+        atomic_store_explicit(&mapped_rooms[id], rooms_of_sensors[id], memory_order_relaxed);
+    }
+    atomic_store(&mapped_sensors, sensors);
+    free(rooms_of_sensors);
+}
+
+/* the room aggregates, indexed by room id, created when the first sensor joins and kept until datamgr_free_map */
+static _Atomic(room_t *) rooms[SENSOR_ID_COUNT];
+static pthread_mutex_t rooms_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \return the aggregates of 'room_id', created if the room has none yet, NULL on memory error
+ */
+static room_t *room_get(uint16_t room_id) {
+    room_t *room = atomic_load(&rooms[room_id]);
+    if (room) return room;
+
+    pthread_mutex_lock(&rooms_mutex);
+    room = atomic_load(&rooms[room_id]);
+    if (!room && (room = calloc(1, sizeof(room_t))) != NULL) {
+        pthread_mutex_init(&room->lock, NULL);
+        room->room_id = room_id;
+        room->min_member = -1;
+        room->max_member = -1;
+        room->min_temp = SET_MIN_TEMP;
+        room->max_temp = SET_MAX_TEMP;
+        atomic_store(&rooms[room_id], room);
+    }
+    pthread_mutex_unlock(&rooms_mutex);
+    return room;
+}
+
+/**
+ * Recomputes the sum, minimum and maximum of a room from its members, the caller holds the room's lock
+ */
+static void room_rescan(room_t *room) {
+    room->sum = 0;
+    room->min_member = -1;
+    room->max_member = -1;
+    for (int i = 0; i < room->slots; i++) {
+        room_member_t *member = &room->members[i];
+        if (member->sensor_id == 0 || !member->reporting) continue;
+        room->sum += member->average;
+        if (room->min_member < 0 || member->average < room->min) {
+            room->min = member->average;
+            room->min_member = i;
+        }
+        if (room->max_member < 0 || member->average > room->max) {
+            room->max = member->average;
+            room->max_member = i;
+        }
+    }
+    room->updates = 0;
+}
+
+/**
+ * Counts the reporting members that have been silent for ROOM_STALE_AFTER seconds before the room's latest reading,
+ * members that never reported are told apart by the reporting count, the caller holds the room's lock
+ */
+static void room_count_stale(room_t *room) {
+    room->stale = 0;
+    for (int i = 0; i < room->slots; i++) {
+        room_member_t *member = &room->members[i];
+        if (member->sensor_id != 0 && member->reporting && room->newest - member->last_seen > ROOM_STALE_AFTER) room->stale++;
+    }
+    room->stale_checked = room->newest;
+}
+
+/**
+ * Copies the aggregates of a room, the caller holds the room's lock
+ */
+static void room_copy_stats(room_t *room, room_stats_t *stats) {
+    stats->room_id = room->room_id;
+    stats->sensors = room->sensors;
+    stats->reporting = room->reporting;
+    stats->stale = room->stale;
+    stats->mean = (room->reporting > 0) ? room->sum / room->reporting : 0;
+    stats->min = (room->min_member >= 0) ? room->min : 0;
+    stats->max = (room->max_member >= 0) ? room->max : 0;
+    stats->alert_level = room->alert.level;
+}
+
+/**
+ * Adds 'sensor' to the members of its room, a sensor that already has an average brings it along
+ * A sensor that is a member already, through the table of another shard, shares that member slot
+ * \return 0 on success, -1 on memory error, the sensor then has no room
+ */
+static int room_join(sensor_data_element_t *sensor) {
+    room_t *room = room_get(sensor->room_id);
+    if (!room) return -1;
+
+    pthread_mutex_lock(&room->lock);
+    int slot = 0;
+    while (slot < room->slots && room->members[slot].sensor_id != sensor->sensor_id) slot++;
+    if (slot < room->slots) {
+        room->members[slot].holders++;
+        pthread_mutex_unlock(&room->lock);
+        sensor->room = room;
+        sensor->member = slot;
+        return 0;
+    }
+    slot = 0;
+    while (slot < room->slots && room->members[slot].sensor_id != 0) slot++;
+    if (slot == room->capacity) {
+        int capacity = (room->capacity == 0) ? 16 : room->capacity * 2;
+        room_member_t *members = realloc(room->members, sizeof(room_member_t) * capacity);
+        if (!members) {
+            pthread_mutex_unlock(&room->lock);
+            return -1;
+        }
+        room->members = members;
+        room->capacity = capacity;
+    }
+    if (slot == room->slots) room->slots++;
+
+    room_member_t *member = &room->members[slot];
+    member->sensor_id = sensor->sensor_id;
+    member->holders = 1;
+    member->reporting = sensor->count > 0;
+    member->average = member->reporting ? sensor->running_sum / sensor->count : 0;
+    member->last_seen = sensor->last_modified;
+    room->sensors++;
+    if (member->reporting) {
+        room->reporting++;
+        room->sum += member->average;
+        if (room->min_member < 0 || member->average < room->min) {
+            room->min = member->average;
+            room->min_member = slot;
+        }
+        if (room->max_member < 0 || member->average > room->max) {
+            room->max = member->average;
+            room->max_member = slot;
+        }
+    }
+    pthread_mutex_unlock(&room->lock);
+
+    sensor->room = room;
+    sensor->member = slot;
+    return 0;
+}
+
+/**
+ * Removes 'sensor' from the members of its room once no table holds it anymore, its slot is reused by the next
+ * sensor that joins
+ */
+static void room_leave(sensor_data_element_t *sensor) {
+    room_t *room = sensor->room;
+    if (!room) return;
+
+    pthread_mutex_lock(&room->lock);
+    room_member_t *member = &room->members[sensor->member];
+    sensor->room = NULL;
+    if (--member->holders > 0) {
+        pthread_mutex_unlock(&room->lock);
+        return;
+    }
+    member->sensor_id = 0;
+    room->sensors--;
+    if (member->reporting) {
+        member->reporting = false;
+        room->reporting--;
+        room->sum -= member->average;
+        if (sensor->member == room->min_member || sensor->member == room->max_member) room_rescan(room);
+    }
+    pthread_mutex_unlock(&room->lock);
+}
+
+/**
+ * Moves the average of 'sensor' in the aggregates of its room to its latest value, in O(1) unless the sensor
+ * was the room's minimum or maximum and moved inwards, and counts the reading in the room's histogram
+ * \param value the reading
+ * \param alerts the alert options if the room's mean is checked against the limits, NULL if not
+ * \param stats Pointer to the copy of the room's aggregates after the update
+ * \return the event of the room's alert state, ALERT_EVENT_NONE if the room is not checked
+ */
+static alert_event_t room_update(sensor_data_element_t *sensor, sensor_value_t value, alert_options_t *alerts,
+                                 room_stats_t *stats) {
+    room_t *room = sensor->room;
+    sensor_value_t average = sensor->running_sum / sensor->count;
+
+    pthread_mutex_lock(&room->lock);
+    int slot = sensor->member;
+    room_member_t *member = &room->members[slot];
+    if (member->reporting) {
+        room->sum += average - member->average;
+    } else {
+        member->reporting = true;
+        room->reporting++;
+        room->sum += average;
+    }
+    member->average = average;
+    member->last_seen = sensor->last_modified;
+    histogram_add(&room->histogram, value);
+    histogram_window_add(&room->recent, value, sensor->last_modified);
+
+    bool rescan = ++room->updates >= ROOM_RESUM_INTERVAL;
+    if (room->min_member < 0 || average <= room->min) {
+        room->min = average;
+        room->min_member = slot;
+    } else if (room->min_member == slot) {
+        rescan = true;
+    }
+    if (room->max_member < 0 || average >= room->max) {
+        room->max = average;
+        room->max_member = slot;
+    } else if (room->max_member == slot) {
+        rescan = true;
+    }
+    if (rescan) room_rescan(room);
+
+    // counting the stale members takes a scan, once per second of readings is often enough
+    if (member->last_seen > room->newest) room->newest = member->last_seen;
+    if (room->newest != room->stale_checked) room_count_stale(room);
+
+    // the state moves under the lock: readings of one room arrive through several workers
+    alert_event_t event = ALERT_EVENT_NONE;
+    if (alerts) {
+        event = alert_update(&room->alert, alerts, room->sum / room->reporting, room->min_temp, room->max_temp,
+                             room->newest);
+    }
+    room_copy_stats(room, stats);
+    pthread_mutex_unlock(&room->lock);
+    return event;
+}
+
+/**
+ * Logs the p50, p95 and p99 of a histogram, as "<subject>: <count> readings, p50 = ..."
+ */
+static void log_quantiles(char *subject, histogram_t *histogram) {
+    char log_message[LOG_MSG_MAX_LEN];
+    snprintf(log_message, sizeof(log_message), "%s: %lu readings, p50 = %.1f, p95 = %.1f, p99 = %.1f, max = %.1f",
+             subject, (unsigned long)histogram->count, histogram_quantile(histogram, 0.5),
+             histogram_quantile(histogram, 0.95), histogram_quantile(histogram, 0.99), histogram->max);
+    write_to_log_process(log_message);
+}
+
+static void load_initial_map() {
+    datamgr_reload_map();
+}
+
+/**
+ * Builds a table from the published map next to the current one, carrying the running averages over,
+ * and replaces the current one with it
+ * \return 0 on success, -1 if there is no map or no memory, the current table then stays
+ */
+static int refresh_sensor_table(sensor_table_t **table, int reader) {
+    sensor_table_t *current = *table;
+    sensor_table_t *fresh = NULL;
+    if (sensor_table_init(&fresh, current->window, current->partition, current->partitions) != 0) return -1;
+    fresh->shard = current->shard;
+    fresh->shards = current->shards;
+    fresh->any_shard = current->any_shard;
+    fresh->alerts = current->alerts;
+    fresh->anomalies = current->anomalies;
+
+    // announced before the map is taken, so the reloader does not free a map we may still copy from
+    atomic_store(&map_readers[reader], atomic_load(&map_generation));
+    sensor_map_t *map = atomic_load(&current_map);
+    int result = (map == NULL) ? -1 : sensor_table_fill(fresh, map, current);
+    atomic_store(&map_readers[reader], 0);
+
+    if (result != 0) {
+        datamgr_cleanup(fresh);
+        return -1;
+    }
+    datamgr_cleanup(current);
+    *table = fresh;
+    return 0;
+}
 
 void *data_manager(void *args) {
     datamanager_arguments_t *params = (datamanager_arguments_t*)args;
-    dplist_t *sensor_list = NULL;
-    sensor_data_t data;
+    sensor_table_t *sensor_table = NULL;
+    sensor_data_t batch[SBUFFER_BATCH_SIZE];
+    int count;
     bool running = true;
 
-    //init sensor list
-    sensor_list = dpl_create(element_copy, element_free, element_compare);
-    if (!sensor_list) {
-        write_to_log_process("Failed to create sensor list");
+    //parse sensor mappings, once for all workers
+    pthread_once(&initial_map_once, load_initial_map);
+    int reader = atomic_fetch_add(&map_reader_count, 1);
+    if (reader >= MAX_MAP_READERS) {
+        write_to_log_process("Too many data manager workers");
+        return NULL;
+    }
+
+    //init sensor table
+    if (sensor_table_init(&sensor_table, params->window, params->worker, params->workers) != 0) {
+        write_to_log_process("Failed to create sensor table");
         return NULL;
     }
+    sensor_table->shard = params->shard;
+    sensor_table->shards = params->shards;
+    sensor_table->any_shard = params->any_shard;
+    sensor_table->alerts = params->alerts;
+    sensor_table->anomalies = params->anomalies;
 
-    //parse sensor mappings
-    if (parse_sensor_map(sensor_list) != 0) {
+    if (refresh_sensor_table(&sensor_table, reader) != 0) {
         write_to_log_process("Failed to parse sensor mapping file");
-        dpl_free(&sensor_list, true);
+        datamgr_cleanup(sensor_table);
         return NULL;
     }
 
     write_to_log_process("Data manager initialized");
     while (running) {
-        int result = sbuffer_read(params->sBuffer, &data, 1);  // Stage 1 = data manager
+        int result = sbuffer_read_batch(params->sBuffer, batch, SBUFFER_BATCH_SIZE, &count, params->stage_id);
 
         if (result == SBUFFER_NO_DATA) {
             running = false;
         } else if (result == SBUFFER_SUCCESS) {
-            process_sensor_data(sensor_list, &data);
+            // a reload published a new map: one atomic load per batch tells, no lock
+            if (atomic_load_explicit(&map_generation, memory_order_acquire) != sensor_table->generation &&
+                refresh_sensor_table(&sensor_table, reader) != 0) {
+                write_to_log_process("Failed to apply the reloaded sensor map");
+            }
+            for (int i = 0; i < count; i++) {
+                process_sensor_data(sensor_table, &batch[i]);
+            }
         } else {
             write_to_log_process("Error reading from buffer in data manager");
             running = false;
         }
     }
     write_to_log_process("Data manager processing complete");
-    datamgr_cleanup(sensor_list);
+    datamgr_cleanup(sensor_table);
     write_to_log_process("Data manager shutting down");
 
     return NULL;
 }
 
-void datamgr_cleanup(dplist_t *list) {
-    if (list) {
-        dpl_free(&list, true);
+void datamgr_cleanup(sensor_table_t *table) {
+    if (table) {
+        for (int i = 0; i < table->count; i++) {
+            room_leave(&table->sensors[i]);
+            free(table->sensors[i].window);
+            free(table->sensors[i].histogram);
+        }
+        free(table->sensors);
+        free(table);
+    }
+}
+
+int sensor_table_init(sensor_table_t **table, int window, int partition, int partitions) {
+    if (window < 1 || window > RUN_AVG_MAX_LENGTH || partitions < 1 || partition < 0 || partition >= partitions) return -1;
+    sensor_table_t *new_table = calloc(1, sizeof(sensor_table_t));
+    if (!new_table) return -1;
+    new_table->window = window;
+    new_table->partition = partition;
+    new_table->partitions = partitions;
+    new_table->shards = 1;
+    *table = new_table;
+    return 0;
+}
+
+sensor_data_element_t *sensor_table_lookup(sensor_table_t *table, sensor_id_t sensor_id) {
+    uint16_t position = table->index[sensor_id];
+    return (position == 0) ? NULL : &table->sensors[position - 1];
+}
+
+/**
+ * limits of one sensor or room from LIMITS_FILE
+ */
+typedef struct limit_override {
+    uint16_t id;
+    int line;                           /**< of the id in the file, a later line wins */
+    sensor_value_t min_temp;
+    sensor_value_t max_temp;
+} limit_override_t;
+
+typedef struct limit_overrides {
+    limit_override_t *overrides;
+    int count;
+    int capacity;
+} limit_overrides_t;
+
+static int compare_override_ids(const void *x, const void *y) {
+    return (int)((limit_override_t*)x)->id - (int)((limit_override_t*)y)->id;
+}
+
+static int compare_overrides(const void *x, const void *y) {
+    int order = compare_override_ids(x, y);
+    return (order != 0) ? order : ((limit_override_t*)x)->line - ((limit_override_t*)y)->line;
+}
+
+static int add_override(limit_overrides_t *list, uint16_t id, int line, sensor_value_t min_temp, sensor_value_t max_temp) {
+    if (list->count == list->capacity) {
+        int capacity = (list->capacity == 0) ? 16 : list->capacity * 2;
+        limit_override_t *overrides = realloc(list->overrides, sizeof(limit_override_t) * capacity);
+        if (!overrides) return -1;
+        list->overrides = overrides;
+        list->capacity = capacity;
     }
+    list->overrides[list->count++] = (limit_override_t){.id = id, .line = line, .min_temp = min_temp, .max_temp = max_temp};
+    return 0;
+}
+
+/**
+ * \return the override of 'id' in a sorted list, the last one in the file if it has several, NULL if there is none
+ */
+static limit_override_t *find_override(limit_overrides_t *list, uint16_t id) {
+    limit_override_t key = {.id = id};
+    limit_override_t *found = bsearch(&key, list->overrides, list->count, sizeof(limit_override_t), compare_override_ids);
+    while (found && found + 1 < list->overrides + list->count && found[1].id == id) found++;
+    return found;
 }
 
-int parse_sensor_map(dplist_t *list) {
+/**
+ * Reads LIMITS_FILE into the default limits and the overrides of sensors and rooms
+ * \return 0 on success or if there is no limits file, -1 on memory error or an invalid line
+ */
+static int read_limits(limit_override_t *defaults, limit_overrides_t *sensors, limit_overrides_t *rooms) {
+    FILE *fp_limits = fopen(LIMITS_FILE, "r");
+    if (!fp_limits) return 0;
+
+    char line[128];
+    char kind[16];
+    char log_message[LOG_MSG_MAX_LEN];
+    unsigned int id;
+    sensor_value_t min_temp;
+    sensor_value_t max_temp;
+    int result = 0;
+    for (int number = 1; result == 0 && fgets(line, sizeof(line), fp_limits); number++) {
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0') continue;
+
+        if (sscanf(start, "default %lf %lf", &min_temp, &max_temp) == 2 && min_temp <= max_temp) {
+            *defaults = (limit_override_t){.min_temp = min_temp, .max_temp = max_temp};
+        } else if (sscanf(start, "%15s %u %lf %lf", kind, &id, &min_temp, &max_temp) == 4 &&
+                   id <= UINT16_MAX && min_temp <= max_temp &&
+                   (strcmp(kind, "sensor") == 0 || strcmp(kind, "room") == 0)) {
+            limit_overrides_t *list = (strcmp(kind, "sensor") == 0) ? sensors : rooms;
+            if (add_override(list, (uint16_t)id, number, min_temp, max_temp) != 0) result = -1;
+        } else {
+            snprintf(log_message, sizeof(log_message), "Invalid line %d in %s", number, LIMITS_FILE);
+            write_to_log_process(log_message);
+            result = -1;
+        }
+    }
+    fclose(fp_limits);
+    return result;
+}
+
+/**
+ * Resolves the limits of every mapping of 'map' from LIMITS_FILE
+ * \return 0 on success, -1 on memory error or an invalid limits file
+ */
+static int resolve_limits(sensor_map_t *map) {
+    limit_override_t defaults = {.min_temp = SET_MIN_TEMP, .max_temp = SET_MAX_TEMP};
+    limit_overrides_t sensors = {0};
+    limit_overrides_t rooms = {0};
+    int result = read_limits(&defaults, &sensors, &rooms);
+
+    if (result == 0) {
+        qsort(sensors.overrides, sensors.count, sizeof(limit_override_t), compare_overrides);
+        qsort(rooms.overrides, rooms.count, sizeof(limit_override_t), compare_overrides);
+        for (int i = 0; i < map->count; i++) {
+            sensor_mapping_t *mapping = &map->mappings[i];
+            limit_override_t *room = find_override(&rooms, mapping->room_id);
+            limit_override_t *sensor = find_override(&sensors, mapping->sensor_id);
+            if (!room) room = &defaults;
+            if (!sensor) sensor = room;
+            mapping->room_min_temp = room->min_temp;
+            mapping->room_max_temp = room->max_temp;
+            mapping->min_temp = sensor->min_temp;
+            mapping->max_temp = sensor->max_temp;
+        }
+    }
+    free(sensors.overrides);
+    free(rooms.overrides);
+    return result;
+}
+
+int parse_sensor_map(sensor_map_t **map) {
     FILE *fp_map = fopen(MAP_FILE, "r");
     if (!fp_map) {
       write_to_log_process("Failed to open room_sensor.map");
       return -1;
     }
 
-    sensor_data_element_t sensor;
+    sensor_map_t *new_map = calloc(1, sizeof(sensor_map_t));
+    int capacity = 0;
     uint16_t room_id;
     uint16_t sensor_id;
 
-    while (fscanf(fp_map, "%hu %hu", &room_id, &sensor_id) == 2) {
-        sensor.sensor_id = sensor_id;
-        sensor.room_id = room_id;
-        sensor.current_index = 0;
-        memset(sensor.running_avg, 0, sizeof(sensor.running_avg));
-        dpl_insert_at_index(list, &sensor, 0, true);
+    while (new_map && fscanf(fp_map, "%hu %hu", &room_id, &sensor_id) == 2) {
+        if (sensor_id == 0) continue;  // the end marker id, no reading ever carries it
+        if (new_map->count == capacity) {
+            capacity = (capacity == 0) ? 64 : capacity * 2;
+            sensor_mapping_t *mappings = realloc(new_map->mappings, sizeof(sensor_mapping_t) * capacity);
+            if (!mappings) {
+                sensor_map_free(&new_map);
+                break;
+            }
+            new_map->mappings = mappings;
+        }
+        new_map->mappings[new_map->count].sensor_id = sensor_id;
+        new_map->mappings[new_map->count].room_id = room_id;
+        new_map->count++;
     }
 
     fclose(fp_map);
+    if (!new_map) return -1;
+    if (resolve_limits(new_map) != 0) {
+        sensor_map_free(&new_map);
+        return -1;
+    }
+    *map = new_map;
+    return 0;
+}
+
+void sensor_map_free(sensor_map_t **map) {
+    if (map && *map) {
+        free((*map)->mappings);
+        free(*map);
+        *map = NULL;
+    }
+}
+
+int sensor_table_fill(sensor_table_t *table, sensor_map_t *map, sensor_table_t *previous) {
+    for (int i = 0; i < map->count; i++) {
+        sensor_id_t sensor_id = map->mappings[i].sensor_id;
+        if (sbuffer_partition_of(sensor_id, table->partitions) != table->partition) continue;
+        // routed like sbuffer_shards_insert_batch, the other shards hold the rest of the map
+        if (!table->any_shard && sensor_id % table->shards != table->shard) continue;
+
+        sensor_data_element_t *mapped = sensor_table_lookup(table, sensor_id);
+        if (mapped) {
+            mapped->room_id = map->mappings[i].room_id;
+            mapped->min_temp = map->mappings[i].min_temp;
+            mapped->max_temp = map->mappings[i].max_temp;
+            continue;
+        }
+        // every sensor id but 0 maps to one position, so a position + 1 always fits in the index
+        if (table->count == table->capacity) {
+            int capacity = (table->capacity == 0) ? 64 : table->capacity * 2;
+            sensor_data_element_t *sensors = realloc(table->sensors, sizeof(sensor_data_element_t) * capacity);
+            if (!sensors) return -1;
+            table->sensors = sensors;
+            table->capacity = capacity;
+        }
+        sensor_data_element_t *sensor = &table->sensors[table->count++];
+        memset(sensor, 0, sizeof(*sensor));
+        sensor->sensor_id = sensor_id;
+        sensor->room_id = map->mappings[i].room_id;
+        sensor->min_temp = map->mappings[i].min_temp;
+        sensor->max_temp = map->mappings[i].max_temp;
+        table->index[sensor_id] = (uint16_t)table->count;
+    }
+
+    // only once nothing can fail anymore, the sensors that stay take their running average along
+    for (int i = 0; previous && i < table->count; i++) {
+        sensor_data_element_t *sensor = &table->sensors[i];
+        sensor_data_element_t *old = sensor_table_lookup(previous, sensor->sensor_id);
+        if (!old) continue;
+        sensor->window = old->window;
+        sensor->running_sum = old->running_sum;
+        sensor->count = old->count;
+        sensor->current_index = old->current_index;
+        sensor->last_modified = old->last_modified;
+        sensor->alert = old->alert;
+        sensor->anomaly = old->anomaly;
+        sensor->histogram = old->histogram;
+        old->window = NULL;
+        old->histogram = NULL;
+        if (old->room_id == sensor->room_id) {
+            sensor->room = old->room;
+            sensor->member = old->member;
+            old->room = NULL;
+        }
+    }
+    for (int i = 0; i < table->count; i++) {
+        sensor_data_element_t *sensor = &table->sensors[i];
+        if (!sensor->room && room_join(sensor) != 0) {
+            char log_message[LOG_MSG_MAX_LEN];
+            snprintf(log_message, sizeof(log_message), "Sensor node %d is left out of the aggregates of room %d",
+                     sensor->sensor_id, sensor->room_id);
+            write_to_log_process(log_message);
+        }
+    }
+    table->generation = map->generation;
     return 0;
 }
 
-void process_sensor_data(dplist_t *list, sensor_data_t *data) {
-    if (!list || !data) return;
+int datamgr_reload_map() {
+    sensor_map_t *map = NULL;
+    if (parse_sensor_map(&map) != 0) return -1;
+
+    pthread_mutex_lock(&reload_mutex);
+    for (int i = 0; i < map->count; i++) {
+        room_t *room = room_get(map->mappings[i].room_id);
+        if (!room) continue;
+        pthread_mutex_lock(&room->lock);
+        room->min_temp = map->mappings[i].room_min_temp;
+        room->max_temp = map->mappings[i].room_max_temp;
+        pthread_mutex_unlock(&room->lock);
+    }
+    map->generation = atomic_load(&map_generation) + 1;
+    sensor_map_t *old = atomic_exchange(&current_map, map);
+    atomic_store(&map_generation, map->generation);
+    publish_mapped_rooms(map);
+
+    // grace period: wait for the workers that may still be copying from the old map
+    int readers = atomic_load(&map_reader_count);
+    for (int i = 0; i < readers && i < MAX_MAP_READERS; i++) {
+        uint64_t reading;
+        while ((reading = atomic_load(&map_readers[i])) != 0 && reading < map->generation) {
+            sched_yield();
+        }
+    }
+    sensor_map_free(&old);
+    pthread_mutex_unlock(&reload_mutex);
+
+    char log_message[LOG_MSG_MAX_LEN];
+    snprintf(log_message, sizeof(log_message), "Loaded sensor map generation %lu with %d mappings",
+             (unsigned long)map->generation, map->count);
+    write_to_log_process(log_message);
+    return 0;
+}
+
+void datamgr_free_map() {
+    pthread_mutex_lock(&reload_mutex);
+    sensor_map_t *map = atomic_exchange(&current_map, NULL);
+    sensor_map_free(&map);
+    pthread_mutex_unlock(&reload_mutex);
+
+    // the rooms merge into the quantiles of the whole gateway
+    histogram_t all_rooms;
+    histogram_init(&all_rooms);
+    for (int id = 0; id < SENSOR_ID_COUNT; id++) {
+        room_t *room = atomic_exchange(&rooms[id], NULL);
+        if (!room) continue;
+        if (room->histogram.count > 0) {
+            char subject[32];
+            snprintf(subject, sizeof(subject), "Room %d", id);
+            log_quantiles(subject, &room->histogram);
+            histogram_merge(&all_rooms, &room->histogram);
+        }
+        pthread_mutex_destroy(&room->lock);
+        free(room->members);
+        free(room);
+    }
+    if (all_rooms.count > 0) log_quantiles("All rooms", &all_rooms);
+}
+
+/**
+ * Reads the pending inotify events
+ * \return true if one of them is about MAP_FILE or LIMITS_FILE
+ */
+static bool map_file_changed(int fd) {
+    _Alignas(struct inotify_event) char events[4096];
+    bool changed = false;
+    ssize_t length;
+    while ((length = read(fd, events, sizeof(events))) > 0) {
+        for (char *event = events; event < events + length; ) {
+            struct inotify_event *change = (struct inotify_event*)event;
+            if (change->len > 0 && (strcmp(change->name, MAP_FILE) == 0 || strcmp(change->name, LIMITS_FILE) == 0)) {
+                changed = true;
+            }
+            event += sizeof(struct inotify_event) + change->len;
+        }
+    }
+    return changed;
+}
+
+void *map_watcher(void *args) {
+    map_watcher_arguments_t *params = (map_watcher_arguments_t*)args;
+
+    // editors often save by renaming a new file over the old one, so the directory is watched instead of the file
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd >= 0 && inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) write_to_log_process("Cannot watch room_sensor.map for changes, send SIGHUP to reload it");
+
+    while (!atomic_load(&params->stop)) {
+        bool changed = false;
+        if (fd >= 0) {
+            struct pollfd watch = {.fd = fd, .events = POLLIN};
+            if (poll(&watch, 1, ACCEPT_POLL_MS) > 0) changed = map_file_changed(fd);
+        } else {
+            struct timespec pause = {.tv_sec = 0, .tv_nsec = ACCEPT_POLL_MS * 1000000L};
+            nanosleep(&pause, NULL);
+        }
+        if (map_reload_requested()) changed = true;
+
+        if (changed && datamgr_reload_map() != 0) {
+            write_to_log_process("Failed to reload the sensor map or limits, keeping the current sensor map");
+        }
+    }
+
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+/**
+ * Adds a reading to the running sum of 'sensor' in O(1): the reading it replaces is subtracted
+ * \return 0 on success, -1 if the window could not be allocated
+ */
+static int add_to_window(sensor_table_t *table, sensor_data_element_t *sensor, sensor_value_t value) {
+    if (!sensor->window) {
+        sensor->window = malloc(sizeof(sensor_value_t) * table->window);
+        if (!sensor->window) return -1;
+    }
+
+    if (sensor->count == table->window) {
+        sensor->running_sum -= sensor->window[sensor->current_index];
+    } else {
+        sensor->count++;
+    }
+    sensor->window[sensor->current_index] = value;
+    sensor->running_sum += value;
+
+    if (++sensor->current_index == table->window) {
+        // the window is full: start every round from an exact sum, so rounding errors do not pile up
+        sensor->current_index = 0;
+        sensor_value_t sum = 0;
+        for (int i = 0; i < table->window; i++) {
+            sum += sensor->window[i];
+        }
+        sensor->running_sum = sum;
+    }
+    return 0;
+}
 
-    sensor_data_element_t dummy = {.sensor_id = data->id};
-    int index = dpl_get_index_of_element(list, &dummy);
+void process_sensor_data(sensor_table_t *table, sensor_data_t *data) {
+    if (!table || !data) return;
 
-    if (index == -1) {
+    sensor_data_element_t *sensor = sensor_table_lookup(table, data->id);
+    if (!sensor) {
         char log_message[300];
         snprintf(log_message, sizeof(log_message), "Received sensor data with invalid sensor node ID %d", data->id);
         write_to_log_process(log_message);
         return;
     }
 
-    sensor_data_element_t *sensor = dpl_get_element_at_index(list, index);
-    if (!sensor) return;
-
-    sensor->running_avg[sensor->current_index] = data->value;
-    sensor->current_index = (sensor->current_index + 1) % RUN_AVG_LENGTH;
+    if (add_to_window(table, sensor, data->value) != 0) {
+        write_to_log_process("Failed to allocate running average window");
+        return;
+    }
+    // the window took the reading already: without a histogram it only misses the sensor's quantiles
+    if (!sensor->histogram) sensor->histogram = calloc(1, sizeof(histogram_t));
+    if (sensor->histogram) histogram_add(sensor->histogram, data->value);
+    else write_to_log_process("Failed to allocate sensor histogram, the reading is left out of its quantiles");
     sensor->last_modified = data->ts;
 
-    check_sensor_limits(sensor);
+    if (sensor->room) {
+        room_stats_t stats;
+        alert_event_t event = room_update(sensor, data->value, (table->alerts.checks & ALERT_ROOMS) ? &table->alerts : NULL, &stats);
+        if (event != ALERT_EVENT_NONE) check_room_limits(&stats, event);
+    }
+    snapshot_publish(table, sensor, data->value);
+    if (table->alerts.checks & ALERT_SENSORS) check_sensor_limits(table, sensor);
+    if (table->anomalies.sigma > 0 || table->anomalies.flatline > 0) check_sensor_anomalies(table, sensor, data->value);
 }
 
-void check_sensor_limits(sensor_data_element_t *sensor) {
-    if (!sensor) return;
+void check_sensor_anomalies(sensor_table_t *table, sensor_data_element_t *sensor, sensor_value_t value) {
+    anomaly_state_t *state = &sensor->anomaly;
+    anomaly_options_t *options = &table->anomalies;
+    char log_message[LOG_MSG_MAX_LEN];
+    log_message[0] = '\0';
 
-    double sum = 0;
-    int valid_readings = 0;
+    if (state->count == 0) {
+        state->mean = value;
+        state->variance = 0;
+        state->previous = value;
+        state->repeats = 1;
+        state->count = 1;
+        return;
+    }
+
+    // compared before the reading moves the mean, as squares: no square root for readings that are fine
+    sensor_value_t difference = value - state->mean;
+    sensor_value_t variance = state->variance;
+    if (variance < ANOMALY_MIN_STDDEV * ANOMALY_MIN_STDDEV) variance = ANOMALY_MIN_STDDEV * ANOMALY_MIN_STDDEV;
+    if (options->sigma > 0 && state->count >= ANOMALY_WARMUP &&
+        difference * difference > options->sigma * options->sigma * variance) {
+        snprintf(log_message, sizeof(log_message),
+                 "Sensor node %d reading %.2f jumps %.1f standard deviations from its moving average %.2f",
+                 sensor->sensor_id, value, fabs(difference) / sqrt(variance), state->mean);
+    }
+
+    // incremental EWMA of the mean and the variance (West), O(1) and no readings kept
+    sensor_value_t increment = ANOMALY_ALPHA * difference;
+    state->mean += increment;
+    state->variance = (1 - ANOMALY_ALPHA) * (state->variance + difference * increment);
+    if (state->count < ANOMALY_WARMUP) state->count++;
 
-    for (int i = 0; i < RUN_AVG_LENGTH; i++) {
-        if (sensor->running_avg[i] != 0) {
-            sum += sensor->running_avg[i];
-            valid_readings++;
+    if (fabs(value - state->previous) <= ANOMALY_FLAT_EPSILON) {
+        state->repeats++;
+        if (options->flatline > 0 && state->repeats >= (uint32_t)options->flatline && log_message[0] == '\0') {
+            snprintf(log_message, sizeof(log_message), "Sensor node %d looks stuck: %u identical readings of %.2f",
+                     sensor->sensor_id, state->repeats, value);
         }
+    } else {
+        state->repeats = 1;
     }
+    state->previous = value;
 
-    if (valid_readings == 0) return;
+    if (log_message[0] == '\0') return;
+    if (state->last_logged != 0 && sensor->last_modified - state->last_logged < table->alerts.interval) return;
+    state->last_logged = sensor->last_modified;
+    write_to_log_process(log_message);
+}
 
-    double avg = sum / valid_readings;
-    char log_message[300];
+alert_event_t alert_update(alert_state_t *state, alert_options_t *options, sensor_value_t average,
+                           sensor_value_t min, sensor_value_t max, time_t now) {
+    int8_t level = ALERT_LEVEL_NORMAL;
+    if (average > max) level = ALERT_LEVEL_TOO_HOT;
+    else if (average < min) level = ALERT_LEVEL_TOO_COLD;
+    else if (state->level == ALERT_LEVEL_TOO_HOT && average > max - options->hysteresis) level = ALERT_LEVEL_TOO_HOT;
+    else if (state->level == ALERT_LEVEL_TOO_COLD && average < min + options->hysteresis) level = ALERT_LEVEL_TOO_COLD;
 
-    if (avg > SET_MAX_TEMP) {
-        snprintf(log_message, sizeof(log_message), "Sensor node %d reports it's too hot (avg temp = %.1f)", sensor->sensor_id, avg);
-        write_to_log_process(log_message);
-    } else if (avg < SET_MIN_TEMP) {
-        snprintf(log_message, sizeof(log_message),"Sensor node %d reports it's too cold (avg temp = %.1f)", sensor->sensor_id, avg);
-        write_to_log_process(log_message);
+    if (level == ALERT_LEVEL_NORMAL) {
+        bool announced = state->announced;
+        state->level = level;
+        state->announced = false;
+        return announced ? ALERT_EVENT_CLEARED : ALERT_EVENT_NONE;
     }
+    // jumping from too hot to too cold (or back) is news, only the same alert again waits for the interval
+    bool switched = state->level != ALERT_LEVEL_NORMAL && level != state->level;
+    if (level != state->level) {
+        state->level = level;
+        state->announced = false;
+    }
+    if (!switched && state->last_alert != 0 && now - state->last_alert < options->interval) return ALERT_EVENT_NONE;
+    alert_event_t event = state->announced ? ALERT_EVENT_REPEATED : ALERT_EVENT_RAISED;
+    state->announced = true;
+    state->last_alert = now;
+    return event;
 }
 
-uint16_t datamgr_get_room_id(sensor_id_t sensor_id) {
-    uint16_t room = 0;
-    sensor_data_t temp = {0};
-    temp.id = sensor_id;
+int datamgr_get_room_stats(uint16_t room_id, room_stats_t *stats) {
+    room_t *room = atomic_load(&rooms[room_id]);
+    if (!room || !stats) return -1;
+    pthread_mutex_lock(&room->lock);
+    room_copy_stats(room, stats);
+    pthread_mutex_unlock(&room->lock);
+    return 0;
+}
 
-    int index = dpl_get_index_of_element(list, &temp);
-    if (index == -1) {
-        fprintf(stderr, "Sensor with that ID not in list\n");
-    }
+int datamgr_get_room_histogram(uint16_t room_id, histogram_t *histogram) {
+    room_t *room = atomic_load(&rooms[room_id]);
+    if (!room || !histogram) return -1;
+    pthread_mutex_lock(&room->lock);
+    *histogram = room->histogram;
+    pthread_mutex_unlock(&room->lock);
+    return 0;
+}
 
-    sensor_data_element_t *node = dpl_get_element_at_index(list, index); //node moet niet gefreed worden want hij point naar iets dat al bestaat
-    room = node->room_id;
+int datamgr_get_room_recent_histograms(uint16_t room_id, histogram_window_t *window) {
+    room_t *room = atomic_load(&rooms[room_id]);
+    if (!room || !window) return -1;
+    pthread_mutex_lock(&room->lock);
+    *window = room->recent;
+    pthread_mutex_unlock(&room->lock);
+    return 0;
+}
 
-    return room;
+/**
+ * \return the words of the log message for an alert event at 'level'
+ */
+static char *alert_description(alert_event_t event, int8_t level) {
+    if (event == ALERT_EVENT_CLEARED) return "is back within limits";
+    if (event == ALERT_EVENT_REPEATED) return (level == ALERT_LEVEL_TOO_HOT) ? "still reports it's too hot" : "still reports it's too cold";
+    return (level == ALERT_LEVEL_TOO_HOT) ? "reports it's too hot" : "reports it's too cold";
 }
 
-time_t datamgr_get_last_modified(sensor_id_t sensor_id) {
-    time_t timestamp = 0;
-    sensor_data_t temp = {0};
-    temp.id = sensor_id;
+void check_room_limits(room_stats_t *stats, alert_event_t event) {
+    if (!stats || event == ALERT_EVENT_NONE) return;
 
-    int index = dpl_get_index_of_element(list, &temp);
+    char log_message[LOG_MSG_MAX_LEN];
+    snprintf(log_message, sizeof(log_message),
+             "Room %d %s (mean temp = %.1f, min = %.1f, max = %.1f, %d of %d sensors reporting, %d stale)",
+             stats->room_id, alert_description(event, stats->alert_level), stats->mean, stats->min, stats->max,
+             stats->reporting, stats->sensors, stats->stale);
+    write_to_log_process(log_message);
+}
 
-    if (index == -1) {
-        fprintf(stderr, "Sensor with that ID not in list\n");
-    }
+void check_sensor_limits(sensor_table_t *table, sensor_data_element_t *sensor) {
+    if (!table || !sensor || sensor->count == 0) return;
 
-    sensor_data_element_t *node = dpl_get_element_at_index(list, index);
-    timestamp = node->last_modified;
+    double avg = sensor->running_sum / sensor->count;
+    alert_event_t event = alert_update(&sensor->alert, &table->alerts, avg, sensor->min_temp, sensor->max_temp,
+                                       sensor->last_modified);
+    if (event == ALERT_EVENT_NONE) return;
 
-    return timestamp;
+    char log_message[300];
+    snprintf(log_message, sizeof(log_message), "Sensor node %d %s (avg temp = %.1f)",
+             sensor->sensor_id, alert_description(event, sensor->alert.level), avg);
+    write_to_log_process(log_message);
 }
 
+int datamgr_get_snapshot(sensor_id_t sensor_id, sensor_snapshot_t *snapshot) {
+    if (!snapshot) return -1;
+    snapshot_slot_t *slot = &snapshots[sensor_id];
+    unsigned int before;
+    unsigned int after;
+    do {
+        before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (before & 1) continue;   // a data manager is writing the slot right now
+        snapshot->readings = atomic_load_explicit(&slot->readings, memory_order_relaxed);
+        snapshot->latest = atomic_load_explicit(&slot->latest, memory_order_relaxed);
+        snapshot->average = atomic_load_explicit(&slot->average, memory_order_relaxed);
+        snapshot->window_full = atomic_load_explicit(&slot->window_full, memory_order_relaxed);
+        snapshot->last_modified = atomic_load_explicit(&slot->last_modified, memory_order_relaxed);
+        snapshot->quantile_readings = atomic_load_explicit(&slot->quantile_readings, memory_order_relaxed);
+        snapshot->p50 = atomic_load_explicit(&slot->p50, memory_order_relaxed);
+        snapshot->p95 = atomic_load_explicit(&slot->p95, memory_order_relaxed);
+        snapshot->p99 = atomic_load_explicit(&slot->p99, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    } while ((before & 1) || before != after);
 
-int datamgr_get_total_sensors() {
-    return dpl_size(list);
+    uint32_t room = atomic_load_explicit(&mapped_rooms[sensor_id], memory_order_relaxed);
+    snapshot->sensor_id = sensor_id;
+    snapshot->mapped = room != 0;
+    snapshot->room_id = (room != 0) ? (uint16_t)(room - 1) : 0;
+    return (snapshot->mapped || snapshot->readings > 0) ? 0 : -1;
 }
 
-void* element_copy(void* element) {
-    sensor_data_element_t* copy = malloc(sizeof(sensor_data_element_t));
-    memcpy(copy, element, sizeof(sensor_data_element_t));
-    return copy;
+uint16_t datamgr_get_room_id(sensor_id_t sensor_id) {
+    uint32_t room = atomic_load_explicit(&mapped_rooms[sensor_id], memory_order_relaxed);
+    ERROR_HANDLER(room == 0, "Sensor with that ID not in the map");
+    return (uint16_t)(room - 1);
+}
+
+sensor_value_t datamgr_get_avg(sensor_id_t sensor_id) {
+    sensor_snapshot_t snapshot;
+    ERROR_HANDLER(datamgr_get_snapshot(sensor_id, &snapshot) != 0, "Sensor with that ID not in the map");
+    return snapshot.window_full ? snapshot.average : 0;
 }
 
-void element_free(void** element) {
-    free(*element);
-    *element = NULL;
+time_t datamgr_get_last_modified(sensor_id_t sensor_id) {
+    sensor_snapshot_t snapshot;
+    ERROR_HANDLER(datamgr_get_snapshot(sensor_id, &snapshot) != 0, "Sensor with that ID not in the map");
+    return snapshot.last_modified;
 }
 
-int element_compare(void* x, void* y) {
-    sensor_data_element_t* element_x = (sensor_data_element_t*)x;
-    sensor_data_element_t* element_y = (sensor_data_element_t*)y;
-    return element_x->sensor_id - element_y->sensor_id;
-}
\ No newline at end of file
+int datamgr_get_total_sensors() {
+    return atomic_load(&mapped_sensors);
+}
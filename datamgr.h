@@ -7,7 +7,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "config.h"
-#include "lib/dplist.h"
+#include "histogram.h"
 
 /*
  * Use ERROR_HANDLER() for handling memory allocation problems, invalid sensor IDs, non-existing files, etc.
@@ -19,11 +19,136 @@
                       }                                             \
                     } while(0)
 
+/**
+ * one line of the room map
+ */
+typedef struct sensor_mapping {
+    sensor_id_t sensor_id;
+    uint16_t room_id;
+    sensor_value_t min_temp;            /**< limits of the sensor, resolved from LIMITS_FILE */
+    sensor_value_t max_temp;
+    sensor_value_t room_min_temp;       /**< limits of the room's mean */
+    sensor_value_t room_max_temp;
+} sensor_mapping_t;
+
+/**
+ * the room map as read from MAP_FILE, never changed once it is published: a reload publishes a new one
+ */
+typedef struct sensor_map {
+    uint64_t generation;                /**< 1 for the map read at startup, one more for every reload */
+    sensor_mapping_t *mappings;         /**< in map file order, without sensor id 0 */
+    int count;
+} sensor_map_t;
+
+/**
+ * a sensor of a room, as far as the room aggregates need it
+ */
+typedef struct room_member {
+    sensor_id_t sensor_id;              /**< 0 for a free slot */
+    int holders;                        /**< sensor tables that joined the sensor to the room, one per shard holding it */
+    bool reporting;                     /**< the sensor has a running average */
+    sensor_value_t average;
+    time_t last_seen;
+} room_member_t;
+
+/**
+ * the live aggregates of one room, shared by every data manager that owns one of its sensors
+ * sum, min and max only cover the members that report, they are updated in O(1) per reading:
+ * only a member that was the minimum or maximum and moved inwards makes the room scan its members
+ */
+typedef struct room {
+    pthread_mutex_t lock;
+    uint16_t room_id;
+    room_member_t *members;
+    int slots;                          /**< members in use or freed, up to capacity */
+    int capacity;
+    int sensors;                        /**< members in use */
+    int reporting;                      /**< members in use that have an average */
+    sensor_value_t sum;                 /**< of the averages of the reporting members */
+    sensor_value_t min;
+    sensor_value_t max;
+    int min_member;                     /**< slot holding the minimum, -1 if no member reports */
+    int max_member;
+    int updates;                        /**< since the sum was last recomputed from the members */
+    time_t newest;                      /**< latest reading of the room */
+    time_t stale_checked;               /**< 'newest' when 'stale' was counted */
+    sensor_value_t min_temp;            /**< limits of the room's mean, set by every map reload */
+    sensor_value_t max_temp;
+    alert_state_t alert;                /**< of the room's mean, changed under the room's lock */
+    histogram_t histogram;              /**< of all readings of the room's sensors, for the quantiles */
+    histogram_window_t recent;          /**< of the readings of the current and the previous HISTOGRAM_WINDOW */
+    int stale;                          /**< reporting members without a reading for ROOM_STALE_AFTER seconds before 'newest' */
+} room_t;
+
+/**
+ * a consistent copy of the aggregates of a room
+ */
+typedef struct room_stats {
+    uint16_t room_id;
+    int sensors;                        /**< sensors mapped to the room */
+    int reporting;                      /**< sensors that have a running average */
+    int stale;                          /**< reporting sensors that went silent, see ROOM_STALE_AFTER */
+    sensor_value_t mean;                /**< of the running averages of the reporting sensors */
+    sensor_value_t min;
+    sensor_value_t max;
+    int8_t alert_level;                 /**< ALERT_LEVEL_NORMAL, ALERT_LEVEL_TOO_HOT or ALERT_LEVEL_TOO_COLD */
+} room_stats_t;
+
+/**
+ * the latest state of a sensor, as any thread can read it without a lock (see datamgr_get_snapshot)
+ */
+typedef struct sensor_snapshot {
+    sensor_id_t sensor_id;
+    bool mapped;                        /**< the sensor is in the current room map */
+    uint16_t room_id;                   /**< its room in the current map, 0 if it is not mapped */
+    uint64_t readings;                  /**< processed since the gateway started */
+    sensor_value_t latest;              /**< the latest reading */
+    sensor_value_t average;             /**< the running average of the latest readings, up to a window of them */
+    bool window_full;                   /**< the running average covers a whole window */
+    time_t last_modified;               /**< timestamp of the latest reading, 0 if there was none */
+    uint64_t quantile_readings;         /**< readings the quantiles cover, 0 if none, see QUANTILE_REFRESH_INTERVAL */
+    sensor_value_t p50;                 /**< quantiles of the sensor's readings, see histogram_quantile */
+    sensor_value_t p95;
+    sensor_value_t p99;
+} sensor_snapshot_t;
+
+/**
+ * what an alert state did with a new average, see alert_update
+ */
+typedef enum {
+    ALERT_EVENT_NONE,                   /**< nothing to log */
+    ALERT_EVENT_RAISED,                 /**< the average went out of the limits */
+    ALERT_EVENT_REPEATED,               /**< it is still out of the limits after the re-alert interval */
+    ALERT_EVENT_CLEARED                 /**< it came back within the limits, by the hysteresis */
+} alert_event_t;
+
+/**
+ * the sensors of the room map, stored contiguously and indexed by sensor id
+ */
+typedef struct sensor_table {
+    sensor_data_element_t *sensors;     /**< in map file order */
+    int count;
+    int capacity;
+    int window;                         /**< length of the running average of every sensor */
+    int partition;                      /**< the table only holds sensors whose id hashes to this partition */
+    int partitions;
+    int shard;                          /**< the shard the table's worker reads, its sensors have id % shards == shard */
+    int shards;
+    bool any_shard;                     /**< readings may reach any shard, the table then holds the other shards' sensors too */
+    uint64_t generation;                /**< generation of the map the table was filled from */
+    alert_options_t alerts;
+    anomaly_options_t anomalies;
+    uint16_t index[SENSOR_ID_COUNT];    /**< position + 1 of every sensor id in 'sensors', 0 if it is not in the map */
+} sensor_table_t;
+
 /**
  * Main data management thread function
  *
- * Responsible for initializing the sensor list, parsing sensor mappings,
+ * Responsible for initializing the sensor table, parsing sensor mappings,
  * and continuously processing incoming sensor data from a shared buffer.
+ * With several workers per shard, every worker reads the partition buffer that only gets
+ * the sensors of its own partition, so each sensor's readings stay in order.
+ * When a reload published a new room map, the worker fills a new table from it before its next batch.
  *
  * @param args Thread arguments containing the shared sensor data buffer
  * @return NULL on completion or error
@@ -32,47 +157,212 @@
 void *data_manager(void *args);
 
 /**
- * Parses the sensor mapping file and populates the sensor list
+ * Parses the sensor mapping file into a new room map
+ *
+ * Reads the room-sensor mappings from the predefined MAP_FILE, skipping sensor id 0,
+ * and resolves the temperature limits of every sensor and room from the optional LIMITS_FILE:
+ * lines "default <min> <max>", "room <room id> <min> <max>" and "sensor <sensor id> <min> <max>",
+ * empty lines and lines starting with '#' are skipped.
+ * A sensor takes its own limits, else those of its room, else the defaults, else SET_MIN_TEMP and SET_MAX_TEMP.
+ * A room takes its own limits, else the defaults, else SET_MIN_TEMP and SET_MAX_TEMP.
+ * The generation of the map is left at 0, datamgr_reload_map sets it when it publishes the map.
+ *
+ * @param map a double pointer, that will be filled out with the new map
+ * @return 0 on success, -1 on file open or memory error, or an invalid line in LIMITS_FILE
+ */
+
+int parse_sensor_map(sensor_map_t **map);
+
+/**
+ * Frees a room map that is not published (anymore)
+ * @param map a double pointer to the map, set to NULL afterwards
+ */
+void sensor_map_free(sensor_map_t **map);
+
+/**
+ * Populates an empty sensor table from a room map
+ *
+ * Appends a sensor data element per mapping of the table's partition and shard and indexes it by sensor id.
+ * A sensor id mapped twice keeps the last room. Every sensor joins the aggregates of its room, the tables of
+ * all shards holding it (see any_shard) share its one member slot, so a room counts each sensor once.
+ * The sensors that are in 'previous' as well take over its running average, their window is moved,
+ * so 'previous' can be cleaned up afterwards without losing it. Sensors that left the map lose theirs.
+ * A sensor that moved to another room brings its average along, the old room loses it at the cleanup of 'previous'.
+ *
+ * @param table Pointer to the empty sensor table to be populated
+ * @param map the room map to fill the table from
+ * @param previous the table the new one replaces, NULL if there is none
+ * @return 0 on success, -1 on memory error, 'previous' is then left untouched
+ */
+int sensor_table_fill(sensor_table_t *table, sensor_map_t *map, sensor_table_t *previous);
+
+/**
+ * Reads MAP_FILE and LIMITS_FILE again and publishes them as the new room map
  *
- * Reads the room-sensor mappings from the predefined MAP_FILE,
- * creating sensor data elements and inserting them into the provided list.
+ * The new map is built next to the current one and swapped in with a single atomic exchange,
+ * so the data managers never take a lock to read it: they see the new generation before their
+ * next batch and rebuild their table. The old map is freed once no data manager copies from it anymore.
+ * The limits of the rooms change right before the new map is published.
+ * A map or limits file that cannot be read leaves the current map in place.
  *
- * @param list Pointer to the dynamic sensor list to be populated
- * @return 0 on success, -1 on file open or parsing error
+ * @return 0 on success, -1 if the map file could not be read
  */
+int datamgr_reload_map();
 
-int parse_sensor_map(dplist_t *list);
+/**
+ * Logs the quantiles of every room and of all rooms together, then frees the published room map and the
+ * room aggregates, call it once every data manager has stopped
+ */
+void datamgr_free_map();
+
+/**
+ * Thread function that reloads the room map when it changes
+ *
+ * Watches the working directory with inotify for MAP_FILE or LIMITS_FILE being written or renamed into place,
+ * and reloads on SIGHUP as well (see request_map_reload). Without inotify only SIGHUP reloads the map.
+ * Stops within ACCEPT_POLL_MS once 'stop' is set.
+ *
+ * @param args Pointer to the watcher parameters (map_watcher_arguments_t)
+ * @return NULL on completion, all error handling done via logging
+ */
+void *map_watcher(void *args);
+
+/**
+ * Creates an empty sensor table
+ * @param table a double pointer, that will be filled out with the new table
+ * @param window the number of readings in the running average of every sensor (1 to RUN_AVG_MAX_LENGTH)
+ * @param partition the partition of sensor ids the table holds, see sbuffer_partition_of
+ * @param partitions the number of partitions, 1 for a table holding every sensor
+ * @return 0 on success, -1 on memory error or invalid arguments
+ */
+int sensor_table_init(sensor_table_t **table, int window, int partition, int partitions);
+
+/**
+ * Looks a sensor up in O(1), with a single access to the index and one to the sensor
+ * @return the sensor element, or NULL if the sensor id is not in the map
+ */
+sensor_data_element_t *sensor_table_lookup(sensor_table_t *table, sensor_id_t sensor_id);
 
 /**
  * Processes incoming sensor data
  *
- * Finds the corresponding sensor in the list, updates its running average,
- * and checks if the sensor's temperature is within acceptable limits.
+ * Finds the corresponding sensor in the table, updates its running average, its histogram, its snapshot
+ * and the aggregates of its room,
+ * and checks if the sensor's and/or the room's temperature is within acceptable limits (see the table's alerts),
+ * and if the reading is an anomaly for the sensor (see the table's anomalies).
  *
- * @param list Pointer to the sensor data list
+ * @param table Pointer to the sensor table
  * @param data Pointer to the incoming sensor data
  */
 
-void process_sensor_data(dplist_t *list, sensor_data_t *data);
+void process_sensor_data(sensor_table_t *table, sensor_data_t *data);
+
+/**
+ * Moves an alert state along with a new average
+ *
+ * The average enters an alert as soon as it crosses 'min' or 'max', and leaves it only once it is
+ * the hysteresis back within them, so an average hovering around a limit does not flap.
+ * Alerts are rate limited on reading time: an alert is raised or repeated at most once per interval,
+ * unless the average jumps from one limit straight past the other. An alert that was never logged is not cleared either.
+ *
+ * @param state Pointer to the alert state of a sensor or room
+ * @param options the hysteresis and re-alert interval
+ * @param average the new average
+ * @param min the lowest average within the limits
+ * @param max the highest average within the limits
+ * @param now the time of the reading that changed the average
+ * @return the event to log
+ */
+alert_event_t alert_update(alert_state_t *state, alert_options_t *options, sensor_value_t average,
+                           sensor_value_t min, sensor_value_t max, time_t now);
+
+/**
+ * Checks a new reading of a sensor for anomalies the fixed limits miss, in O(1) without keeping readings
+ *
+ * Keeps an exponentially weighted moving mean and variance of the sensor's readings, and logs
+ * - a jump: a reading further than the table's sigma standard deviations from the mean, once the mean is warmed up
+ * - a flatline: the table's flatline count of identical readings in a row, the sensor is probably stuck
+ * Both are logged at most once per re-alert interval of the sensor.
+ *
+ * @param table Pointer to the sensor table, holding the anomaly and alert options
+ * @param sensor Pointer to the sensor data element the reading belongs to
+ * @param value the new reading
+ */
+void check_sensor_anomalies(sensor_table_t *table, sensor_data_element_t *sensor, sensor_value_t value);
+
+/**
+ * Copies the current aggregates of a room, without waiting for more than the room's own lock
+ * @param room_id the room to look for
+ * @param stats Pointer to the copy to fill out
+ * @return 0 on success, -1 if no sensor of the map was ever in the room
+ */
+int datamgr_get_room_stats(uint16_t room_id, room_stats_t *stats);
+
+/**
+ * Copies the histogram of all readings of a room's sensors, for its quantiles (see histogram_quantile)
+ * Histograms of several rooms can be merged with histogram_merge
+ * @param room_id the room to look for
+ * @param histogram Pointer to the copy to fill out
+ * @return 0 on success, -1 if no sensor of the map was ever in the room
+ */
+int datamgr_get_room_histogram(uint16_t room_id, histogram_t *histogram);
+
+/**
+ * Copies the histograms of a room's readings in the current and the previous HISTOGRAM_WINDOW
+ * The windows of all rooms start at the same seconds: windows with the same 'start' merge with histogram_merge
+ * @param room_id the room to look for
+ * @param window Pointer to the copy to fill out
+ * @return 0 on success, -1 if no sensor of the map was ever in the room
+ */
+int datamgr_get_room_recent_histograms(uint16_t room_id, histogram_window_t *window);
+
+/**
+ * Logs an alert event of a room
+ *
+ * Logs a message with the room's mean, min, max and sensor counts if the mean became or still is
+ * too hot or too cold, or came back within the limits.
+ *
+ * @param stats Pointer to the aggregates of the room, taken when the event happened
+ * @param event what the room's alert state did, see alert_update
+ */
+void check_room_limits(room_stats_t *stats, alert_event_t event);
 
 /**
  * Checks if a sensor's temperature is within acceptable limits
  *
- * Calculates the running average temperature and logs a message
- * if the temperature is too hot or too cold.
+ * Takes the running average temperature from the running sum in O(1), compares it with the sensor's own limits,
+ * stored next to its running sum, moves the sensor's alert state
+ * along with it and logs a message when it became or still is too hot or too cold, or came back within the limits.
  *
+ * @param table Pointer to the sensor table, holding the alert options
  * @param sensor Pointer to the sensor data element to check
  */
 
-void check_sensor_limits(sensor_data_element_t *sensor);
+void check_sensor_limits(sensor_table_t *table, sensor_data_element_t *sensor);
+/**
+ * This method should be called to clean up a sensor table, and to free all used memory.
+ * The snapshots of its sensors stay readable, the datamgr_get_* functions keep answering.
+ */
+void datamgr_cleanup(sensor_table_t *table);
+
 /**
- * This method should be called to clean up the datamgr, and to free all used memory.
- * After this, any call to datamgr_get_room_id, datamgr_get_avg, datamgr_get_last_modified or datamgr_get_total_sensors will not return a valid result
+ * Reads the latest state of a sensor, from any thread
+ *
+ * Every sensor has a slot guarded by a sequence counter (a seqlock): the data manager bumps it around
+ * every update, a reader copies the slot and tries again if the counter moved or was odd meanwhile.
+ * The data managers never wait for readers, readers only retry while the slot is being written.
+ * Known limitation with -S: the average, window and quantiles are those of the shard that processed the
+ * latest reading. A node that reconnects through another listener starts over in that shard, and while
+ * readings of one sensor still arrive through two shards the snapshot alternates between their averages.
+ *
+ * @param sensor_id the sensor id to look for
+ * @param snapshot Pointer to the copy to fill out
+ * @return 0 on success, -1 if the sensor is not in the map and never had a reading processed
  */
-void datamgr_cleanup(dplist_t *list);
+int datamgr_get_snapshot(sensor_id_t sensor_id, sensor_snapshot_t *snapshot);
 
 /**
- * Gets the room ID for a certain sensor ID
+ * Gets the room ID for a certain sensor ID, from the current room map
  * Use ERROR_HANDLER() if sensor_id is invalid
  * \param sensor_id the sensor id to look for
  * \return the corresponding room id
@@ -80,7 +370,7 @@ void datamgr_cleanup(dplist_t *list);
 uint16_t datamgr_get_room_id(sensor_id_t sensor_id);
 
 /**
- * Gets the running AVG of a certain senor ID (if less then RUN_AVG_LENGTH measurements are recorded the avg is 0)
+ * Gets the running AVG of a certain senor ID (if less than a window of measurements is recorded the avg is 0)
  * Use ERROR_HANDLER() if sensor_id is invalid
  * \param sensor_id the sensor id to look for
  * \return the running AVG of the given sensor
@@ -96,14 +386,9 @@ sensor_value_t datamgr_get_avg(sensor_id_t sensor_id);
 time_t datamgr_get_last_modified(sensor_id_t sensor_id);
 
 /**
- *  Return the total amount of unique sensor ID's recorded by the datamgr
+ *  Return the total amount of unique sensor ID's in the current room map
  *  \return the total amount of sensors
  */
 int datamgr_get_total_sensors();
 
-//element functions
-void *element_copy(void *element);
-void element_free(void **element);
-int element_compare(void *x, void *y);
-
 #endif //DATAMGR_H
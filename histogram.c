@@ -0,0 +1,73 @@
+//
+// Created by sodir on 10/17/26.
+//
+
+#include "histogram.h"
+#include <string.h>
+
+void histogram_init(histogram_t *histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+void histogram_add(histogram_t *histogram, sensor_value_t value) {
+    if (histogram->count == 0 || value < histogram->min) histogram->min = value;
+    if (histogram->count == 0 || value > histogram->max) histogram->max = value;
+    histogram->count++;
+
+    // written so that a NaN reading lands below the buckets instead of in a cast of it
+    if (!(value >= HISTOGRAM_LOWEST)) histogram->below++;
+    else if (value >= HISTOGRAM_LOWEST + HISTOGRAM_BUCKETS * HISTOGRAM_WIDTH) histogram->above++;
+    else histogram->buckets[(int)((value - HISTOGRAM_LOWEST) / HISTOGRAM_WIDTH)]++;
+}
+
+void histogram_merge(histogram_t *into, histogram_t *from) {
+    if (from->count == 0) return;
+    if (into->count == 0 || from->min < into->min) into->min = from->min;
+    if (into->count == 0 || from->max > into->max) into->max = from->max;
+    into->count += from->count;
+    into->below += from->below;
+    into->above += from->above;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+void histogram_window_init(histogram_window_t *window) {
+    memset(window, 0, sizeof(*window));
+}
+
+void histogram_window_add(histogram_window_t *window, sensor_value_t value, time_t ts) {
+    time_t start = ts - ts % HISTOGRAM_WINDOW;
+    if (start > window->start) {
+        if (window->start != 0 && start == window->start + HISTOGRAM_WINDOW) window->previous = window->current;
+        else histogram_init(&window->previous);
+        histogram_init(&window->current);
+        window->start = start;
+    }
+
+    if (start == window->start) histogram_add(&window->current, value);
+    else if (start == window->start - HISTOGRAM_WINDOW) histogram_add(&window->previous, value);
+}
+
+sensor_value_t histogram_quantile(histogram_t *histogram, double q) {
+    if (histogram->count == 0) return 0;
+    if (q <= 0) return histogram->min;
+    if (q >= 1) return histogram->max;
+
+    double exact_rank = q * (double)histogram->count;
+    uint64_t rank = (uint64_t)exact_rank;
+    if ((double)rank < exact_rank) rank++;
+    uint64_t seen = histogram->below;
+    if (rank <= seen) return histogram->min;
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (rank <= seen) {
+            sensor_value_t middle = HISTOGRAM_LOWEST + (i + 0.5) * HISTOGRAM_WIDTH;
+            if (middle < histogram->min) return histogram->min;
+            if (middle > histogram->max) return histogram->max;
+            return middle;
+        }
+    }
+    return histogram->max;
+}
@@ -0,0 +1,75 @@
+//
+// Created by sodir on 10/17/26.
+//
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include "config.h"
+
+#define HISTOGRAM_BUCKETS 256
+#define HISTOGRAM_LOWEST -40.0      // lower bound of the first bucket
+#define HISTOGRAM_WIDTH 0.5         // degrees per bucket, quantiles are exact to half of it within the buckets
+#define HISTOGRAM_WINDOW 3600       // seconds of reading timestamps covered by one window of a windowed histogram
+
+/**
+ * a fixed-bucket histogram of readings, the same size however many readings it counts
+ * histograms of different sensors, shards or time windows merge by adding them up
+ * readings outside the buckets are counted apart, quantiles that fall there report the exact min or max
+ */
+typedef struct histogram {
+    uint64_t count;
+    uint64_t below;                 /**< readings under HISTOGRAM_LOWEST */
+    uint64_t above;                 /**< readings at or over the end of the last bucket */
+    sensor_value_t min;
+    sensor_value_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];   /**< as wide as 'count': a histogram of a room lives as long as the gateway */
+} histogram_t;
+
+/**
+ * the histograms of the current and the previous time window, aligned to multiples of HISTOGRAM_WINDOW
+ * on the reading timestamps, so the windows of all rooms and shards line up and merge
+ */
+typedef struct histogram_window {
+    time_t start;                   /**< first second of the current window, 0 before the first reading */
+    histogram_t current;
+    histogram_t previous;           /**< the window that ended at 'start', empty if it had no readings */
+} histogram_window_t;
+
+/**
+ * Empties a histogram
+ */
+void histogram_init(histogram_t *histogram);
+
+/**
+ * Counts a reading in O(1)
+ */
+void histogram_add(histogram_t *histogram, sensor_value_t value);
+
+/**
+ * Adds the readings of 'from' to 'into'
+ */
+void histogram_merge(histogram_t *into, histogram_t *from);
+
+/**
+ * Estimates a quantile, the value of the bucket holding the reading at rank ceil(q * count)
+ * \param q the quantile, 0 to 1 (0.5 for the median, 0.99 for p99)
+ * \return the estimate, clamped to the min and max reading, 0 for an empty histogram
+ */
+sensor_value_t histogram_quantile(histogram_t *histogram, double q);
+
+/**
+ * Empties a windowed histogram
+ */
+void histogram_window_init(histogram_window_t *window);
+
+/**
+ * Counts a reading in the window its timestamp falls in, in O(1)
+ * A reading of a later window starts it: the current window becomes the previous one if they are adjacent,
+ * otherwise both are emptied. A reading older than the previous window is not counted.
+ * \param ts the timestamp of the reading
+ */
+void histogram_window_add(histogram_window_t *window, sensor_value_t value, time_t ts);
+
+#endif //HISTOGRAM_H
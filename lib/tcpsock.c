@@ -11,6 +11,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include "tcpsock.h"
 
@@ -56,12 +58,27 @@ struct tcpsock {
     int sd;             /**< socket descriptor */
     char *ip_addr;      /**< socket IP address */
     int port;           /**< socket port number */
+    char *rx_buf;       /**< receive buffer for tcp_fill_buffer, NULL until first used */
+    int rx_start;       /**< first buffered byte that was not consumed */
+    int rx_end;         /**< end of the buffered bytes */
+    int nonblocking;    /**< set by tcp_set_nonblocking: EAGAIN means no data instead of a receive timeout */
 };
 
 static tcpsock_t *tcp_sock_create();
+static int tcp_make_buffer_room(tcpsock_t *socket);
+static int tcp_listen(tcpsock_t **sock, int port, int reuse_port);
 
 int tcp_passive_open(tcpsock_t **sock, int port) {
+    return tcp_listen(sock, port, 0);
+}
+
+int tcp_passive_open_shared(tcpsock_t **sock, int port) {
+    return tcp_listen(sock, port, 1);
+}
+
+static int tcp_listen(tcpsock_t **sock, int port, int reuse_port) {
     int result;
+    int enable = 1;
     struct sockaddr_in addr;
     TCP_ERR_HANDLER(((port < MIN_PORT) || (port > MAX_PORT)), return TCP_ADDRESS_ERROR);
     tcpsock_t *s = tcp_sock_create();
@@ -69,6 +86,13 @@ int tcp_passive_open(tcpsock_t **sock, int port) {
     s->sd = socket(PROTOCOLFAMILY, TYPE, PROTOCOL);
     TCP_DEBUG_PRINTF(s->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(s->sd < 0, free(s);return TCP_SOCKOP_ERROR);
+    // rebind right away after a restart, even with connections of the previous run in TIME_WAIT
+    setsockopt(s->sd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (reuse_port) {
+        result = setsockopt(s->sd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+        TCP_DEBUG_PRINTF(result == -1, "Setsockopt() failed with errno = %d [%s]", errno, strerror(errno));
+        TCP_ERR_HANDLER(result != 0, close(s->sd);free(s);return TCP_SOCKOP_ERROR);
+    }
     // Construct the server address structure
     memset(&addr, 0, sizeof(struct sockaddr_in));
     addr.sin_family = PROTOCOLFAMILY;
@@ -76,10 +100,10 @@ int tcp_passive_open(tcpsock_t **sock, int port) {
     addr.sin_port = htons(port);
     result = bind(s->sd, (struct sockaddr *) &addr, sizeof(addr));
     TCP_DEBUG_PRINTF(result == -1, "Bind() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(s);return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(result != 0, close(s->sd);free(s);return TCP_SOCKOP_ERROR);
     result = listen(s->sd, MAX_PENDING);
     TCP_DEBUG_PRINTF(result == -1, "Listen() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(s);return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(result != 0, close(s->sd);free(s);return TCP_SOCKOP_ERROR);
     s->ip_addr = NULL; // address set to INADDR_ANY - not a specific IP address
     s->port = port;
     s->cookie = MAGIC_COOKIE;
@@ -134,6 +158,7 @@ int tcp_close(tcpsock_t **socket) {
         {
             free((*socket)->ip_addr);
         }
+        free((*socket)->rx_buf);
         if ((*socket)->sd >= 0) {
             // maybe a connection is still open?
             result = shutdown((*socket)->sd, SHUT_RDWR);
@@ -150,6 +175,7 @@ int tcp_close(tcpsock_t **socket) {
     (*socket)->port = -1;
     (*socket)->sd = -1;
     (*socket)->ip_addr = NULL;
+    (*socket)->rx_buf = NULL;
     free(*socket);
     *socket = NULL;
     return TCP_NO_ERROR;
@@ -178,6 +204,38 @@ int tcp_wait_for_connection(tcpsock_t *socket, tcpsock_t **new_socket) {
     return TCP_NO_ERROR;
 }
 
+int tcp_adopt_connection(tcpsock_t **new_socket, int sd) {
+    struct sockaddr_in addr;
+    tcpsock_t *s;
+    unsigned int length = sizeof(struct sockaddr_in);
+    char *p;
+
+    TCP_ERR_HANDLER(sd < 0, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(getpeername(sd, (struct sockaddr *) &addr, &length) == -1, return TCP_SOCKOP_ERROR);
+    s = tcp_sock_create();
+    TCP_ERR_HANDLER(s == NULL, return TCP_MEMORY_ERROR);
+    s->sd = sd;
+    p = inet_ntoa(addr.sin_addr);  //returns addr to statically allocated buffer
+    s->ip_addr = (char *) malloc(sizeof(char) * CHAR_IP_ADDR_LENGTH);
+    TCP_ERR_HANDLER(s->ip_addr == NULL, free(s);return TCP_MEMORY_ERROR);
+    s->ip_addr = strncpy(s->ip_addr, p, CHAR_IP_ADDR_LENGTH);
+    s->port = ntohs(addr.sin_port);
+    s->cookie = MAGIC_COOKIE;
+    *new_socket = s;
+    return TCP_NO_ERROR;
+}
+
+int tcp_wait_for_connection_timeout(tcpsock_t *socket, tcpsock_t **new_socket, int timeout_ms) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    struct pollfd pfd = {.fd = socket->sd, .events = POLLIN};
+    int result = poll(&pfd, 1, timeout_ms);
+    TCP_DEBUG_PRINTF((result == -1) && (errno != EINTR), "Poll() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER((result == 0) || ((result == -1) && (errno == EINTR)), return TCP_TIMEOUT_ERROR);
+    TCP_ERR_HANDLER(result == -1, return TCP_SOCKOP_ERROR);
+    return tcp_wait_for_connection(socket, new_socket);
+}
+
 int tcp_send(tcpsock_t *socket, void *buffer, int *buf_size) {
     TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
     TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
@@ -211,6 +269,8 @@ int tcp_receive(tcpsock_t *socket, void *buffer, int *buf_size) {
     *buf_size = recv(socket->sd, buffer, *buf_size, 0);
     TCP_DEBUG_PRINTF(*buf_size == 0, "Recv() : no connection to peer\n");
     TCP_ERR_HANDLER(*buf_size == 0, return TCP_CONNECTION_CLOSED);
+    TCP_ERR_HANDLER((*buf_size < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)),
+                    *buf_size = 0;return socket->nonblocking ? TCP_WOULD_BLOCK : TCP_TIMEOUT_ERROR);
     TCP_DEBUG_PRINTF((*buf_size < 0) && (errno == ENOTCONN), "Recv() : no connection to peer\n");
     TCP_ERR_HANDLER((*buf_size < 0) && (errno == ENOTCONN), return TCP_CONNECTION_CLOSED);
     TCP_DEBUG_PRINTF(*buf_size < 0, "Recv() failed with errno = %d [%s]", errno, strerror(errno));
@@ -222,12 +282,12 @@ int tcp_receive_with_timeout(tcpsock_t *socket, void *buffer, int *buf_size, int
     //inspiration from https://stackoverflow.com/questions/67882330/socket-timeout-select-vs-setsockopt and
     //https://stackoverflow.com/questions/36913075/tcp-socket-timeout-or-no-data-to-read/36913150#36913150
     //to choose for setsockopt to handle timeout.
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
     struct timeval timeout;
     timeout.tv_sec = timeout_sec;
     timeout.tv_usec = 0;
     setsockopt(socket->sd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof timeout);
-    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
-    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
     if ((buffer == NULL) || (buf_size == 0))  //nothing to read
     {
         *buf_size = 0;
@@ -235,6 +295,7 @@ int tcp_receive_with_timeout(tcpsock_t *socket, void *buffer, int *buf_size, int
     }
     *buf_size = recv(socket->sd, buffer, *buf_size, 0);
     TCP_ERR_HANDLER(*buf_size == 0, return TCP_CONNECTION_CLOSED);
+    TCP_ERR_HANDLER((*buf_size < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)), return TCP_TIMEOUT_ERROR);
     TCP_DEBUG_PRINTF((*buf_size < 0) && (errno == ENOTCONN), "Recv() : no connection to peer\n");
     TCP_ERR_HANDLER((*buf_size < 0) && (errno == ENOTCONN), return TCP_CONNECTION_CLOSED);
     TCP_DEBUG_PRINTF(*buf_size < 0, "Recv() failed with errno = %d [%s]", errno, strerror(errno));
@@ -242,6 +303,74 @@ int tcp_receive_with_timeout(tcpsock_t *socket, void *buffer, int *buf_size, int
     return TCP_NO_ERROR;
 }
 
+int tcp_set_nonblocking(tcpsock_t *socket) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    int flags = fcntl(socket->sd, F_GETFL, 0);
+    TCP_DEBUG_PRINTF(flags == -1, "Fcntl() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(flags == -1, return TCP_SOCKOP_ERROR);
+    int result = fcntl(socket->sd, F_SETFL, flags | O_NONBLOCK);
+    TCP_DEBUG_PRINTF(result == -1, "Fcntl() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result == -1, return TCP_SOCKOP_ERROR);
+    socket->nonblocking = 1;
+    return TCP_NO_ERROR;
+}
+
+int tcp_set_receive_timeout(tcpsock_t *socket, int timeout_sec) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    struct timeval timeout = {.tv_sec = timeout_sec, .tv_usec = 0};
+    int result = setsockopt(socket->sd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof timeout);
+    TCP_DEBUG_PRINTF(result == -1, "Setsockopt() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result == -1, return TCP_SOCKOP_ERROR);
+    return TCP_NO_ERROR;
+}
+
+int tcp_fill_buffer(tcpsock_t *socket, int *bytes) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    *bytes = 0;
+    TCP_ERR_HANDLER(tcp_make_buffer_room(socket) != TCP_NO_ERROR, return TCP_MEMORY_ERROR);
+    if (socket->rx_end == TCP_RECV_BUFFER_SIZE) return TCP_NO_ERROR;
+
+    int received = recv(socket->sd, socket->rx_buf + socket->rx_end, TCP_RECV_BUFFER_SIZE - socket->rx_end, 0);
+    TCP_DEBUG_PRINTF(received == 0, "Recv() : no connection to peer\n");
+    TCP_ERR_HANDLER(received == 0, return TCP_CONNECTION_CLOSED);
+    TCP_ERR_HANDLER((received < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)),
+                    return socket->nonblocking ? TCP_WOULD_BLOCK : TCP_TIMEOUT_ERROR);
+    TCP_DEBUG_PRINTF((received < 0) && (errno == ENOTCONN), "Recv() : no connection to peer\n");
+    TCP_ERR_HANDLER((received < 0) && (errno == ENOTCONN), return TCP_CONNECTION_CLOSED);
+    TCP_DEBUG_PRINTF(received < 0, "Recv() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(received < 0, return TCP_SOCKOP_ERROR);
+    socket->rx_end += received;
+    *bytes = received;
+    return TCP_NO_ERROR;
+}
+
+int tcp_append_buffer(tcpsock_t *socket, const void *data, int size) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(tcp_make_buffer_room(socket) != TCP_NO_ERROR, return TCP_MEMORY_ERROR);
+    TCP_ERR_HANDLER((size < 0) || (size > TCP_RECV_BUFFER_SIZE - socket->rx_end), return TCP_MEMORY_ERROR);
+    memcpy(socket->rx_buf + socket->rx_end, data, size);
+    socket->rx_end += size;
+    return TCP_NO_ERROR;
+}
+
+void *tcp_peek_buffer(tcpsock_t *socket, int size) {
+    if ((socket == NULL) || (socket->rx_buf == NULL)) return NULL;
+    if (socket->rx_end - socket->rx_start < size) return NULL;
+    return socket->rx_buf + socket->rx_start;
+}
+
+int tcp_consume_buffer(tcpsock_t *socket, int size) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER((size < 0) || (size > socket->rx_end - socket->rx_start), return TCP_MEMORY_ERROR);
+    socket->rx_start += size;
+    if (socket->rx_start == socket->rx_end) socket->rx_start = socket->rx_end = 0;
+    return TCP_NO_ERROR;
+}
+
 int tcp_get_ip_addr(tcpsock_t *socket, char **ip_addr) {
     TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
     TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
@@ -271,6 +400,27 @@ static tcpsock_t *tcp_sock_create() {
         s->port = -1;
         s->ip_addr = NULL;
         s->sd = -1;
+        s->rx_buf = NULL;
+        s->rx_start = 0;
+        s->rx_end = 0;
+        s->nonblocking = 0;
     }
     return s;
 }
+
+/**
+ * Allocates the receive buffer on first use and moves a partial frame to the front,
+ * so the free space is one contiguous block at the end
+ */
+static int tcp_make_buffer_room(tcpsock_t *socket) {
+    if (socket->rx_buf == NULL) {
+        socket->rx_buf = (char *) malloc(TCP_RECV_BUFFER_SIZE);
+        if (socket->rx_buf == NULL) return TCP_MEMORY_ERROR;
+    }
+    if (socket->rx_start > 0) {
+        memmove(socket->rx_buf, socket->rx_buf + socket->rx_start, socket->rx_end - socket->rx_start);
+        socket->rx_end -= socket->rx_start;
+        socket->rx_start = 0;
+    }
+    return TCP_NO_ERROR;
+}
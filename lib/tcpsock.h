@@ -15,8 +15,10 @@
 #define    TCP_CONNECTION_CLOSED    4   // send/receive indicate connection is closed
 #define    TCP_MEMORY_ERROR         5   // mem alloc error
 #define    TCP_TIMEOUT_ERROR        6
+#define    TCP_WOULD_BLOCK          7   // non-blocking socket has no data queued right now
 
-#define MAX_PENDING 10
+#define MAX_PENDING 128     // listen backlog, large enough for all nodes reconnecting at once
+#define TCP_RECV_BUFFER_SIZE 4096   // size of the per socket buffer used by tcp_fill_buffer
 
 typedef struct tcpsock tcpsock_t;
 
@@ -34,6 +36,15 @@ typedef struct tcpsock tcpsock_t;
  */
 int tcp_passive_open(tcpsock_t **socket, int port);
 
+/**
+ * Same as tcp_passive_open, but with SO_REUSEPORT: several sockets (e.g. one per accept thread) can listen
+ * on the same port, and the kernel spreads the incoming connections over them
+ * \param socket a double pointer, that will be filled out with the newly created socket
+ * \param port a port number between MIN_PORT and MAX_PORT
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_passive_open_shared(tcpsock_t **socket, int port);
+
 /**
  * Creates a new TCP socket and opens a TCP connection to the system with IP address 'remote_ip' on port 'remote_port'
  * The newly created socket is return as '*socket'
@@ -73,6 +84,27 @@ int tcp_close(tcpsock_t **socket);
  */
 int tcp_wait_for_connection(tcpsock_t *socket, tcpsock_t **new_socket);
 
+/**
+ * Same as tcp_wait_for_connection, but gives up after 'timeout_ms' milliseconds
+ * If no connection setup request arrives in time (or the wait is interrupted by a signal), TCP_TIMEOUT_ERROR is returned
+ * \param socket the socket that needs to be monitored for a new incomming connection
+ * \param new_socket a double pointer, that will be filled out with the newly created socket for the connection with the client
+ * \param timeout_ms the maximum time to wait in milliseconds
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_wait_for_connection_timeout(tcpsock_t *socket, tcpsock_t **new_socket, int timeout_ms);
+
+/**
+ * Creates a new socket for a connection that was accepted some other way (e.g. by an io_uring accept)
+ * The peer's IP address and port are looked up with getpeername
+ * If 'sd' is not a connected socket descriptor, TCP_SOCKET_ERROR or TCP_SOCKOP_ERROR is returned
+ * If memory allocation for the new socket fails, TCP_MEMORY_ERROR is returned
+ * \param new_socket a double pointer, that will be filled out with the newly created socket
+ * \param sd the socket descriptor of the accepted connection, owned by the new socket afterwards
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_adopt_connection(tcpsock_t **new_socket, int sd);
+
 /**
  * Initiates a send command on the socket 'socket' and tries to send the total '*buf_size' bytes of data in 'buffer' (recall that the function might block for a while)
  * The function sets '*buf_size' to the number of bytes that were really sent, which might be less than the initial '*buf_size'
@@ -92,6 +124,8 @@ int tcp_send(tcpsock_t *socket, void *buffer, int *buf_size);
  * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
  * \param socket the socket where the data needs to be received from
  * \param buffer a pointer to the buffer that can store the data that is received
+ * If the socket is non-blocking and no data is queued, TCP_WOULD_BLOCK is returned
+ * If a receive timeout was set with tcp_set_receive_timeout and it expires, TCP_TIMEOUT_ERROR is returned
  * \param buf_size the amount of bytes that will be read from the socket
  * \return TCP_NO_ERROR if no error occurs during execution
  */
@@ -104,6 +138,65 @@ int tcp_receive(tcpsock_t *socket, void *buffer, int *buf_size);
  */
 int tcp_receive_with_timeout(tcpsock_t *socket, void *buffer, int *buf_size, int timeout_sec);
 
+/**
+ * Puts 'socket' in non-blocking mode: tcp_receive returns TCP_WOULD_BLOCK instead of waiting for data
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * If the socket operation (fcntl) fails, TCP_SOCKOP_ERROR is returned
+ * \param socket the socket to change
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_set_nonblocking(tcpsock_t *socket);
+
+/**
+ * Sets the receive timeout of 'socket' once (SO_RCVTIMEO), instead of on every receive like tcp_receive_with_timeout
+ * A blocking tcp_receive or tcp_fill_buffer then returns TCP_TIMEOUT_ERROR when no data arrives in time
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * If the socket operation (setsockopt) fails, TCP_SOCKOP_ERROR is returned
+ * \param socket the socket to change
+ * \param timeout_sec the timeout in seconds, 0 to wait forever
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_set_receive_timeout(tcpsock_t *socket, int timeout_sec);
+
+/**
+ * Receives as many bytes as are queued on 'socket' (up to the free space) into the socket's own receive buffer
+ * with a single recv; bytes that were not consumed yet are kept, so frames may be split over several calls
+ * Blocks until at least one byte arrives, unless the socket is non-blocking (then TCP_WOULD_BLOCK is returned)
+ * The buffer of TCP_RECV_BUFFER_SIZE bytes is allocated on the first call and freed by tcp_close
+ * If the buffer is full, '*bytes' is set to 0 and TCP_NO_ERROR is returned: consume frames first
+ * Other errors are the same as for tcp_receive, TCP_TIMEOUT_ERROR if a receive timeout expires
+ * \param socket the socket to receive from
+ * \param bytes a pointer to an int that will hold the number of bytes that were added to the buffer
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_fill_buffer(tcpsock_t *socket, int *bytes);
+
+/**
+ * Adds 'size' bytes that were received some other way (e.g. by an io_uring completion) to the receive buffer of 'socket'
+ * If they do not fit next to the bytes that were not consumed yet, TCP_MEMORY_ERROR is returned
+ * \param socket the socket the bytes were received on
+ * \param data the received bytes
+ * \param size the number of bytes
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_append_buffer(tcpsock_t *socket, const void *data, int size);
+
+/**
+ * Returns a pointer to the first 'size' buffered bytes of 'socket', without consuming them
+ * \param socket the socket
+ * \param size the number of bytes needed, at most TCP_RECV_BUFFER_SIZE
+ * \return a pointer into the receive buffer, or NULL if fewer than 'size' bytes are buffered
+ */
+void *tcp_peek_buffer(tcpsock_t *socket, int size);
+
+/**
+ * Drops the first 'size' buffered bytes of 'socket', typically after a frame was parsed with tcp_peek_buffer
+ * \param socket the socket
+ * \param size the number of bytes to drop, at most the number of buffered bytes
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_consume_buffer(tcpsock_t *socket, int size);
+
 /**
  * Set '*ip_addr' to the IP address of 'socket' (could be NULL if the IP address is not set)
  * No memory allocation is done (pointer reference assignment!), hence, no free must be called to avoid a memory leak
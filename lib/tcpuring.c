@@ -0,0 +1,385 @@
+//
+// Created by sodir on 10/17/26.
+//
+// io_uring backend for tcpsock, talking to the kernel with raw system calls (no liburing)
+// Accepts and receives are multishot: one submission keeps producing completions, and received
+// bytes land in a ring of provided buffers shared by all sockets, so idle connections pin no memory
+
+#define _GNU_SOURCE
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "tcpuring.h"
+
+#define TCP_URING_BUFFER_GROUP 0
+
+/**
+ * One multishot operation, its address is the user_data of the submission
+ */
+typedef struct tcp_uring_op {
+    int type;                   /**< TCP_URING_ACCEPT or TCP_URING_RECEIVE */
+    tcpsock_t *socket;          /**< NULL once cancelled, the op is freed with its last completion */
+    int sd;
+    void *user_data;
+    bool armed;                 /**< the kernel can still post completions for this op */
+    struct tcp_uring_op *prev;  /**< list of all ops of the ring, also the cancelled ones */
+    struct tcp_uring_op *next;
+} tcp_uring_op_t;
+
+struct tcp_uring {
+    int fd;
+    void *rings;                /**< submission and completion ring, mapped once (IORING_FEAT_SINGLE_MMAP) */
+    size_t rings_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;              /**< TCP_URING_BUFFERS buffers of TCP_URING_BUFFER_SIZE bytes */
+    tcp_uring_op_t **by_sd;     /**< the live op of every socket descriptor */
+    int by_sd_len;
+    tcp_uring_op_t *ops;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_release(tcp_uring_t *r) {
+    while (r->ops) {
+        tcp_uring_op_t *next = r->ops->next;
+        free(r->ops);
+        r->ops = next;
+    }
+    if (r->fd >= 0) close(r->fd);
+    if (r->rings) munmap(r->rings, r->rings_size);
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->buf_ring) munmap(r->buf_ring, TCP_URING_BUFFERS * sizeof(struct io_uring_buf));
+    free(r->buffers);
+    free(r->by_sd);
+    free(r);
+}
+
+/**
+ * Hands buffer 'bid' back to the kernel
+ */
+static void uring_recycle_buffer(tcp_uring_t *r, int bid) {
+    unsigned short tail = r->buf_ring->tail;
+    // only addr, len and bid: the resv field of the first entry holds the tail
+    struct io_uring_buf *buf = &r->buf_ring->bufs[tail & (TCP_URING_BUFFERS - 1)];
+    buf->addr = (uintptr_t) (r->buffers + (size_t) bid * TCP_URING_BUFFER_SIZE);
+    buf->len = TCP_URING_BUFFER_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&r->buf_ring->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+static unsigned uring_pending_submissions(tcp_uring_t *r) {
+    return *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Returns a cleared submission queue entry, the kernel only sees it after uring_push
+ * \return NULL if the submission queue stays full
+ */
+static struct io_uring_sqe *uring_get_sqe(tcp_uring_t *r) {
+    if (uring_pending_submissions(r) >= r->sq_entries) {
+        uring_enter(r->fd, r->sq_entries, 0, 0, NULL, 0);
+        if (uring_pending_submissions(r) >= r->sq_entries) return NULL;
+    }
+    unsigned index = *r->sq_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    return sqe;
+}
+
+static void uring_push(tcp_uring_t *r) {
+    __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_arm(tcp_uring_t *r, tcp_uring_op_t *op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (sqe == NULL) return TCP_SOCKOP_ERROR;
+    sqe->fd = op->sd;
+    sqe->user_data = (uintptr_t) op;
+    if (op->type == TCP_URING_ACCEPT) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = TCP_URING_BUFFER_GROUP;
+    }
+    uring_push(r);
+    op->armed = true;
+    return TCP_NO_ERROR;
+}
+
+static void uring_free_op(tcp_uring_t *r, tcp_uring_op_t *op) {
+    if (op->prev) op->prev->next = op->next;
+    else r->ops = op->next;
+    if (op->next) op->next->prev = op->prev;
+    free(op);
+}
+
+/**
+ * Queues a multishot operation of 'type' for 'socket', or re-arms the one it already has
+ */
+static int uring_start(tcp_uring_t *r, tcpsock_t *socket, int type, void *user_data) {
+    int sd;
+    if (r == NULL || tcp_get_sd(socket, &sd) != TCP_NO_ERROR) return TCP_SOCKET_ERROR;
+    if (sd >= r->by_sd_len) {
+        int len = (r->by_sd_len > 0) ? r->by_sd_len : 64;
+        while (len <= sd) len *= 2;
+        tcp_uring_op_t **by_sd = realloc(r->by_sd, len * sizeof(tcp_uring_op_t *));
+        if (by_sd == NULL) return TCP_MEMORY_ERROR;
+        memset(by_sd + r->by_sd_len, 0, (len - r->by_sd_len) * sizeof(tcp_uring_op_t *));
+        r->by_sd = by_sd;
+        r->by_sd_len = len;
+    }
+
+    tcp_uring_op_t *op = r->by_sd[sd];
+    if (op == NULL) {
+        op = malloc(sizeof(tcp_uring_op_t));
+        if (op == NULL) return TCP_MEMORY_ERROR;
+        op->prev = NULL;
+        op->next = r->ops;
+        if (r->ops) r->ops->prev = op;
+        r->ops = op;
+        op->armed = false;
+        r->by_sd[sd] = op;
+    } else if (op->armed) {
+        return TCP_NO_ERROR;
+    }
+    op->type = type;
+    op->socket = socket;
+    op->sd = sd;
+    op->user_data = user_data;
+    return uring_arm(r, op);
+}
+
+/**
+ * Turns one completion into an event in events[*count], or handles it internally
+ * \return false if the received bytes do not fit in the socket's receive buffer before the
+ * caller consumed the events returned so far, the completion is then left in the queue
+ */
+static bool uring_complete(tcp_uring_t *r, struct io_uring_cqe *cqe, tcp_uring_event_t *events, int *count) {
+    tcp_uring_op_t *op = (tcp_uring_op_t *) (uintptr_t) cqe->user_data;
+    if (op == NULL) return true;  // completion of a cancel request
+
+    tcp_uring_event_t *event = &events[*count];
+    event->type = op->type;
+    event->result = TCP_NO_ERROR;
+    event->socket = op->socket;
+    event->user_data = op->user_data;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (op->socket && cqe->res > 0) {
+            event->result = tcp_append_buffer(op->socket, r->buffers + (size_t) bid * TCP_URING_BUFFER_SIZE, cqe->res);
+            if (event->result == TCP_MEMORY_ERROR && *count > 0) return false;
+        }
+        uring_recycle_buffer(r, bid);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) op->armed = false;
+    if (op->socket == NULL) {  // cancelled: drop what still arrives, free the op after its last completion
+        if (op->type == TCP_URING_ACCEPT && cqe->res >= 0) close(cqe->res);
+        if (!op->armed) uring_free_op(r, op);
+        return true;
+    }
+
+    if (op->type == TCP_URING_ACCEPT) {
+        if (cqe->res >= 0) {
+            event->result = tcp_adopt_connection(&event->socket, cqe->res);
+            if (event->result != TCP_NO_ERROR) close(cqe->res);
+        } else {
+            event->result = TCP_SOCKOP_ERROR;
+            event->socket = NULL;
+        }
+        if (event->result == TCP_NO_ERROR) {
+            (*count)++;
+            if (!op->armed) uring_arm(r, op);
+        } else if (!op->armed) {
+            (*count)++;  // accepting stopped, tcp_uring_accept starts it again
+        }
+        return true;
+    }
+
+    if (cqe->res > 0) {
+        (*count)++;
+        // the kernel may end a multishot receive at any time, just start it again
+        if (!op->armed && event->result == TCP_NO_ERROR) uring_arm(r, op);
+    } else if (cqe->res == -ENOBUFS) {
+        if (!op->armed) uring_arm(r, op);  // all provided buffers were in use
+    } else {
+        event->result = (cqe->res == 0 || cqe->res == -ECONNRESET) ? TCP_CONNECTION_CLOSED : TCP_SOCKOP_ERROR;
+        (*count)++;
+    }
+    return true;
+}
+
+int tcp_uring_init(tcp_uring_t **ring) {
+    struct io_uring_params params;
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+
+    *ring = NULL;
+    tcp_uring_t *r = calloc(1, sizeof(tcp_uring_t));
+    if (r == NULL) return TCP_MEMORY_ERROR;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 4 * TCP_URING_QUEUE_DEPTH;  // multishot operations complete more often than we submit
+    r->fd = uring_setup(TCP_URING_QUEUE_DEPTH, &params);
+    if (r->fd < 0 || (params.features & needed) != needed) {
+        uring_release(r);
+        return TCP_SOCKOP_ERROR;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    r->rings_size = (sq_size > cq_size) ? sq_size : cq_size;
+    r->rings = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->rings == MAP_FAILED) r->rings = NULL;
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) r->sqes = NULL;
+    r->buf_ring = mmap(NULL, TCP_URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->buf_ring == MAP_FAILED) r->buf_ring = NULL;
+    r->buffers = malloc((size_t) TCP_URING_BUFFERS * TCP_URING_BUFFER_SIZE);
+    if (!r->rings || !r->sqes || !r->buf_ring || !r->buffers) {
+        uring_release(r);
+        return TCP_MEMORY_ERROR;
+    }
+
+    char *base = r->rings;
+    r->sq_head = (unsigned *) (base + params.sq_off.head);
+    r->sq_tail = (unsigned *) (base + params.sq_off.tail);
+    r->sq_mask = (unsigned *) (base + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (base + params.sq_off.array);
+    r->sq_entries = params.sq_entries;
+    r->cq_head = (unsigned *) (base + params.cq_off.head);
+    r->cq_tail = (unsigned *) (base + params.cq_off.tail);
+    r->cq_mask = (unsigned *) (base + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (base + params.cq_off.cqes);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t) r->buf_ring;
+    reg.ring_entries = TCP_URING_BUFFERS;
+    reg.bgid = TCP_URING_BUFFER_GROUP;
+    if (uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_release(r);
+        return TCP_SOCKOP_ERROR;
+    }
+    for (int bid = 0; bid < TCP_URING_BUFFERS; bid++) {
+        uring_recycle_buffer(r, bid);
+    }
+    *ring = r;
+    return TCP_NO_ERROR;
+}
+
+int tcp_uring_free(tcp_uring_t **ring) {
+    if (ring == NULL || *ring == NULL) return TCP_SOCKET_ERROR;
+    tcp_uring_t *r = *ring;
+
+    // the kernel may still write into our buffers until every operation is cancelled
+    tcp_uring_op_t *op = r->ops;
+    while (op) {
+        tcp_uring_op_t *next = op->next;
+        if (op->socket) tcp_uring_cancel(r, op->socket);
+        op = next;
+    }
+    for (int tries = 0; r->ops != NULL && tries < 10; tries++) {
+        tcp_uring_event_t events[16];
+        int count;
+        if (tcp_uring_wait(r, events, 16, 100, &count) != TCP_NO_ERROR) break;
+    }
+    uring_release(r);
+    *ring = NULL;
+    return TCP_NO_ERROR;
+}
+
+int tcp_uring_accept(tcp_uring_t *ring, tcpsock_t *server, void *user_data) {
+    return uring_start(ring, server, TCP_URING_ACCEPT, user_data);
+}
+
+int tcp_uring_receive(tcp_uring_t *ring, tcpsock_t *socket, void *user_data) {
+    return uring_start(ring, socket, TCP_URING_RECEIVE, user_data);
+}
+
+int tcp_uring_cancel(tcp_uring_t *ring, tcpsock_t *socket) {
+    int sd;
+    if (ring == NULL || tcp_get_sd(socket, &sd) != TCP_NO_ERROR) return TCP_SOCKET_ERROR;
+    if (sd >= ring->by_sd_len || ring->by_sd[sd] == NULL) return TCP_NO_ERROR;
+
+    tcp_uring_op_t *op = ring->by_sd[sd];
+    ring->by_sd[sd] = NULL;
+    if (!op->armed) {
+        uring_free_op(ring, op);
+        return TCP_NO_ERROR;
+    }
+    op->socket = NULL;
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) return TCP_SOCKOP_ERROR;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) op;
+    sqe->user_data = 0;
+    uring_push(ring);
+    return TCP_NO_ERROR;
+}
+
+int tcp_uring_wait(tcp_uring_t *ring, tcp_uring_event_t *events, int max, int timeout_ms, int *count) {
+    if (ring == NULL || count == NULL) return TCP_SOCKET_ERROR;
+    *count = 0;
+
+    // submit everything queued and wait in one system call, unless completions are waiting already
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct __kernel_timespec timeout = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (uintptr_t) &timeout;
+        int result = uring_enter(ring->fd, uring_pending_submissions(ring), 1,
+                                 IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (result < 0 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return TCP_SOCKOP_ERROR;
+        }
+    } else if (uring_pending_submissions(ring) > 0) {
+        uring_enter(ring->fd, uring_pending_submissions(ring), 0, 0, NULL, 0);
+    }
+
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && *count < max) {
+        if (!uring_complete(ring, &ring->cqes[head & *ring->cq_mask], events, count)) break;
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return TCP_NO_ERROR;
+}
@@ -0,0 +1,92 @@
+//
+// Created by sodir on 10/17/26.
+//
+
+#ifndef __TCPURING_H__
+#define __TCPURING_H__
+
+#include "tcpsock.h"
+
+#define TCP_URING_QUEUE_DEPTH   256     // submission queue entries, the completion queue is 4 times larger
+#define TCP_URING_BUFFERS       256     // provided receive buffers shared by all sockets of a ring (power of 2)
+#define TCP_URING_BUFFER_SIZE   2048    // size of one provided buffer, at most half of TCP_RECV_BUFFER_SIZE
+
+#define TCP_URING_ACCEPT        1       // a new connection was accepted on a listening socket
+#define TCP_URING_RECEIVE       2       // bytes were added to the receive buffer of a socket, or it failed
+
+typedef struct tcp_uring tcp_uring_t;
+
+/**
+ * One completed operation, as returned by tcp_uring_wait
+ */
+typedef struct tcp_uring_event {
+    int type;               /**< TCP_URING_ACCEPT or TCP_URING_RECEIVE */
+    int result;             /**< TCP_NO_ERROR, or the tcp error that ended the operation */
+    tcpsock_t *socket;      /**< the accepted socket, or the socket that received data */
+    void *user_data;        /**< as given to tcp_uring_accept or tcp_uring_receive */
+} tcp_uring_event_t;
+
+/**
+ * Creates an io_uring instance with a ring of TCP_URING_BUFFERS provided receive buffers
+ * Only raw system calls are used, no liburing
+ * If the kernel lacks io_uring or one of the features used (multishot accept and receive,
+ * provided buffer rings, waiting with a timeout), TCP_SOCKOP_ERROR is returned so the caller can fall back to epoll
+ * \param ring a double pointer, that will be filled out with the new ring
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_uring_init(tcp_uring_t **ring);
+
+/**
+ * Cancels all operations, waits (briefly) for them to finish and frees the ring
+ * The sockets themselves are not closed
+ * \param ring a double pointer to the ring, set to NULL afterwards
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_uring_free(tcp_uring_t **ring);
+
+/**
+ * Queues a multishot accept on the listening socket 'server': every accepted connection
+ * produces a TCP_URING_ACCEPT event until tcp_uring_cancel is called for 'server'
+ * Like all operations, it is only submitted to the kernel by the next tcp_uring_wait
+ * \param ring the ring
+ * \param server a socket opened with tcp_passive_open
+ * \param user_data returned with every event of this operation
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_uring_accept(tcp_uring_t *ring, tcpsock_t *server, void *user_data);
+
+/**
+ * Queues a multishot receive on 'socket' using the provided buffers: received bytes are
+ * appended to the receive buffer of 'socket' (see tcp_peek_buffer) and reported with a
+ * TCP_URING_RECEIVE event, until the connection closes or tcp_uring_cancel is called
+ * Consume complete frames after every event: tcp_uring_wait returns early when the next bytes do not
+ * fit next to unconsumed ones, and reports TCP_MEMORY_ERROR if they never will
+ * \param ring the ring
+ * \param socket a connected socket
+ * \param user_data returned with every event of this operation
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_uring_receive(tcp_uring_t *ring, tcpsock_t *socket, void *user_data);
+
+/**
+ * Cancels the operation queued for 'socket', later calls of tcp_uring_wait return no more events for it
+ * (events already returned by an earlier call may still refer to it)
+ * Call it before closing a socket that has an accept or receive queued
+ * \param ring the ring
+ * \param socket the socket
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_uring_cancel(tcp_uring_t *ring, tcpsock_t *socket);
+
+/**
+ * Submits all queued operations and waits for completed ones, with a single system call
+ * \param ring the ring
+ * \param events an array that will be filled out with at most 'max' events
+ * \param max the size of 'events'
+ * \param timeout_ms the maximum time to wait for a first event in milliseconds
+ * \param count a pointer to an int that will hold the number of events, 0 after a timeout or a signal
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_uring_wait(tcp_uring_t *ring, tcp_uring_event_t *events, int max, int timeout_ms, int *count);
+
+#endif  //__TCPURING_H__
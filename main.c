@@ -1,6 +1,8 @@
 //
 // Created by sodir on 12/9/24.
 //
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,11 +11,13 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
 #include "config.h"
 #include "sbuffer.h"
 #include "connmgr.h"
 #include "datamgr.h"
 #include "sensor_db.h"
+#include "rollup.h"
 
 int fd[2];
 pid_t pid;
@@ -25,6 +29,34 @@ pthread_mutex_t pipemutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t shutdown_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t shutdown_complete;
 int active_threads = 0;
+volatile sig_atomic_t shutdown_flag = 0;
+atomic_bool reload_flag = false;
+
+void request_shutdown() {
+    shutdown_flag = 1;
+}
+
+bool shutdown_requested() {
+    return shutdown_flag != 0;
+}
+
+static void handle_shutdown_signal(int signal) {
+    (void)signal;
+    request_shutdown();
+}
+
+void request_map_reload() {
+    atomic_store(&reload_flag, true);
+}
+
+bool map_reload_requested() {
+    return atomic_exchange(&reload_flag, false);
+}
+
+static void handle_reload_signal(int signal) {
+    (void)signal;
+    request_map_reload();
+}
 
 void increment_active_threads() {
     pthread_mutex_lock(&shutdown_mutex);
@@ -41,9 +73,219 @@ void decrement_active_threads() {
     pthread_mutex_unlock(&shutdown_mutex);
 }
 
+static void print_usage(char *name) {
+    printf("Usage: %s <port> <max_connections> [-m mode] [-t io_threads] [-r] [-l listeners] [-S] [-u udp_port] [-s shards] [-d workers] [-w window] [-a alerts] [-y hysteresis] [-i interval] [-k sigma] [-f samples] [-R resolutions] [-c capacity] [-p policy] [-H high] [-L low]\n", name);
+    printf("\t%-12s : connection handling: threads (one thread per connection, default), epoll or uring\n", "-m mode");
+    printf("\t%-12s : number of epoll I/O threads (1 to %d, default one per core)\n", "-t io_threads", MAX_IO_THREADS);
+    printf("\t%-12s : long-running: keep accepting until SIGINT/SIGTERM, max_connections caps concurrent connections\n", "-r");
+    printf("\t%-12s : number of SO_REUSEPORT listening sockets, each with its own accept loop (1 to %d)\n", "-l listeners", MAX_LISTENERS);
+    printf("\t%-12s : listener i feeds shard i instead of routing by sensor id (a reconnecting node may change shard)\n", "-S");
+    printf("\t%-12s : also accept readings as UDP datagrams on this port, read with recvmmsg (default off)\n", "-u udp_port");
+    printf("\t%-12s : number of independent buffer/data manager/storage manager pipelines (1 to %d)\n", "-s shards", MAX_SHARDS);
+    printf("\t%-12s : data manager workers per shard, each owns the sensors whose id hashes to it (1 to %d)\n", "-d workers", MAX_DATA_WORKERS);
+    printf("\t%-12s : readings in the running average of a sensor (1 to %d, default %d)\n", "-w window", RUN_AVG_MAX_LENGTH, RUN_AVG_LENGTH);
+    printf("\t%-12s : averages checked against the thresholds: sensor (default), room or both\n", "-a alerts");
+    printf("\t%-12s : degrees an average must come back within the limits to end an alert (default %.1f)\n", "-y hysteresis", ALERT_HYSTERESIS);
+    printf("\t%-12s : min seconds between two alerts of a sensor or room, 0 alerts on every reading (default %d)\n", "-i interval", ALERT_INTERVAL);
+    printf("\t%-12s : log readings further than this many standard deviations from a sensor's moving average (default off)\n", "-k sigma");
+    printf("\t%-12s : log sensors that send this many identical readings in a row (default off)\n", "-f samples");
+    printf("\t%-12s : also write per-sensor rollups of these window lengths in seconds, e.g. 60,300,3600 (default off)\n", "-R resolutions");
+    printf("\t%-12s : max records per shared buffer (default %d)\n", "-c capacity", SBUFFER_CAPACITY);
+    printf("\t%-12s : overflow policy: block, drop-oldest, drop-newest or reject (default block)\n", "-p policy");
+    printf("\t%-12s : buffer size at which connections stop reading (default %d%% of capacity)\n", "-H high", SBUFFER_HIGH_WATERMARK);
+    printf("\t%-12s : buffer size at which connections read again (default %d%% of capacity)\n", "-L low", SBUFFER_LOW_WATERMARK);
+}
+
+static int parse_alert_checks(char *name, int *alerts) {
+    if (strcmp(name, "sensor") == 0) *alerts = ALERT_SENSORS;
+    else if (strcmp(name, "room") == 0) *alerts = ALERT_ROOMS;
+    else if (strcmp(name, "both") == 0) *alerts = ALERT_SENSORS | ALERT_ROOMS;
+    else return -1;
+    return 0;
+}
+
+static int parse_resolutions(char *list, int *resolutions, int *count) {
+    *count = 0;
+    for (char *item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+        int resolution = atoi(item);
+        if (*count == ROLLUP_MAX_RESOLUTIONS || resolution < 1 || resolution > ROLLUP_MAX_RESOLUTION) return -1;
+        resolutions[(*count)++] = resolution;
+    }
+    return (*count > 0) ? 0 : -1;
+}
+
+static int parse_policy(char *name, sbuffer_policy_t *policy) {
+    if (strcmp(name, "block") == 0) *policy = SBUFFER_POLICY_BLOCK;
+    else if (strcmp(name, "drop-oldest") == 0) *policy = SBUFFER_POLICY_DROP_OLDEST;
+    else if (strcmp(name, "drop-newest") == 0) *policy = SBUFFER_POLICY_DROP_NEWEST;
+    else if (strcmp(name, "reject") == 0) *policy = SBUFFER_POLICY_REJECT;
+    else return -1;
+    return 0;
+}
+
+static void log_one_buffer_stats(const char *label, sbuffer_t *buffer) {
+    char log_message[LOG_MSG_MAX_LEN];
+    sbuffer_stats_t stats;
+    sbuffer_stage_stats_t stage_stats;
+
+    if (sbuffer_get_stats(buffer, &stats) != SBUFFER_SUCCESS) return;
+    snprintf(log_message, sizeof(log_message),
+             "%s: %lu inserted, %lu dropped oldest, %lu dropped newest, %lu rejected",
+             label, (unsigned long)stats.inserted, (unsigned long)stats.dropped_oldest,
+             (unsigned long)stats.dropped_newest, (unsigned long)stats.rejected);
+    write_to_log_process(log_message);
+
+    for (int stage = 1; stage <= SBUFFER_MAX_STAGES; stage++) {
+        if (sbuffer_get_stage_stats(buffer, stage, &stage_stats) != SBUFFER_SUCCESS) continue;
+        snprintf(log_message, sizeof(log_message),
+                 "%s stage %d (%s): %lu read, lag %lu, max lag %lu",
+                 label, stage, stage_stats.name, (unsigned long)stage_stats.records_read,
+                 (unsigned long)stage_stats.lag, (unsigned long)stage_stats.max_lag);
+        write_to_log_process(log_message);
+    }
+}
+
+static void log_buffer_stats(sbuffer_shards_t *buffers) {
+    char label[64];
+    int partitions = sbuffer_shards_partition_count(buffers);
+
+    for (int i = 0; i < sbuffer_shards_count(buffers); i++) {
+        snprintf(label, sizeof(label), "Shared buffer %d", i);
+        log_one_buffer_stats(label, sbuffer_shard_at(buffers, i));
+        for (int p = 0; partitions > 1 && p < partitions; p++) {
+            snprintf(label, sizeof(label), "Shared buffer %d partition %d", i, p);
+            log_one_buffer_stats(label, sbuffer_partition_at(buffers, i, p));
+        }
+    }
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        printf("Wrong number of arguments\nUsage: %s <port> <max_connections>\n", argv[0]);
+    int shard_count = 1;
+    connmgr_mode_t conn_mode = CONNMGR_MODE_THREADS;
+    int io_threads = 0;
+    bool long_running = false;
+    int listeners = 1;
+    bool listener_shards = false;
+    int udp_port = 0;
+    int avg_window = RUN_AVG_LENGTH;
+    int data_workers = 1;
+    int rollup_resolutions[ROLLUP_MAX_RESOLUTIONS];
+    int rollup_count = 0;
+    anomaly_options_t anomalies = {.sigma = 0, .flatline = 0};
+    alert_options_t alerts = {.checks = ALERT_SENSORS, .hysteresis = ALERT_HYSTERESIS, .interval = ALERT_INTERVAL};
+    int high_watermark = -1;
+    int low_watermark = -1;
+    sbuffer_options_t buffer_options;
+    int opt;
+
+    sbuffer_default_options(&buffer_options);
+    while ((opt = getopt(argc, argv, "m:t:rl:Su:s:d:w:a:y:i:k:f:R:c:p:H:L:")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "threads") == 0) conn_mode = CONNMGR_MODE_THREADS;
+                else if (strcmp(optarg, "epoll") == 0) conn_mode = CONNMGR_MODE_EPOLL;
+                else if (strcmp(optarg, "uring") == 0) conn_mode = CONNMGR_MODE_URING;
+                else {
+                    printf("Invalid connection mode '%s'\n", optarg);
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 't':
+                io_threads = atoi(optarg);
+                break;
+            case 'r':
+                long_running = true;
+                break;
+            case 'l':
+                listeners = atoi(optarg);
+                break;
+            case 'S':
+                listener_shards = true;
+                break;
+            case 'u':
+                udp_port = atoi(optarg);
+                // MAX_PORT itself does not fit in the 16 bits of a port, htons would truncate it
+                if (udp_port < MIN_PORT || udp_port >= MAX_PORT) {
+                    printf("Invalid UDP port '%s'\n", optarg);
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 's':
+                shard_count = atoi(optarg);
+                break;
+            case 'd':
+                data_workers = atoi(optarg);
+                break;
+            case 'w':
+                avg_window = atoi(optarg);
+                break;
+            case 'a':
+                if (parse_alert_checks(optarg, &alerts.checks) != 0) {
+                    printf("Invalid alerts '%s'\n", optarg);
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'y':
+                alerts.hysteresis = atof(optarg);
+                break;
+            case 'i':
+                alerts.interval = atoi(optarg);
+                break;
+            case 'k':
+                anomalies.sigma = atof(optarg);
+                break;
+            case 'f':
+                anomalies.flatline = atoi(optarg);
+                break;
+            case 'R':
+                if (parse_resolutions(optarg, rollup_resolutions, &rollup_count) != 0) {
+                    printf("Invalid rollup resolutions '%s': up to %d window lengths of 1 to %d seconds\n",
+                           optarg, ROLLUP_MAX_RESOLUTIONS, ROLLUP_MAX_RESOLUTION);
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'c':
+                buffer_options.capacity = atoi(optarg);
+                break;
+            case 'p':
+                if (parse_policy(optarg, &buffer_options.policy) != 0) {
+                    printf("Invalid overflow policy '%s'\n", optarg);
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'H':
+                high_watermark = atoi(optarg);
+                break;
+            case 'L':
+                low_watermark = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (io_threads == 0) {
+        // default: one I/O thread per core
+        io_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (io_threads < 1) io_threads = 1;
+        if (io_threads > MAX_IO_THREADS) io_threads = MAX_IO_THREADS;
+    }
+
+    //watermarks default to a percentage of the (possibly changed) capacity
+    buffer_options.high_watermark = (high_watermark >= 0) ? high_watermark
+                                    : buffer_options.capacity * SBUFFER_HIGH_WATERMARK / 100;
+    buffer_options.low_watermark = (low_watermark >= 0) ? low_watermark
+                                   : buffer_options.capacity * SBUFFER_LOW_WATERMARK / 100;
+
+    if (argc - optind != 2) {
+        printf("Wrong number of arguments\n");
+        print_usage(argv[0]);
         return -1;
     }
     if (pthread_cond_init(&shutdown_complete, NULL) != 0) {
@@ -51,13 +293,55 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    int tcp_port = atoi(argv[1]);
-    int max_conn = atoi(argv[2]);
+    int tcp_port = atoi(argv[optind]);
+    int max_conn = atoi(argv[optind + 1]);
 
     if (tcp_port < 1024 || max_conn <= 0) {
         printf("Invalid arguments: port must be >= 1024, max connections must be > 0\n");
         return -1;
     }
+    if (io_threads < 1 || io_threads > MAX_IO_THREADS) {
+        printf("Invalid arguments: I/O threads must be between 1 and %d\n", MAX_IO_THREADS);
+        return -1;
+    }
+    if (listeners < 1 || listeners > MAX_LISTENERS) {
+        printf("Invalid arguments: listeners must be between 1 and %d\n", MAX_LISTENERS);
+        return -1;
+    }
+    if (shard_count < 1 || shard_count > MAX_SHARDS) {
+        printf("Invalid arguments: shards must be between 1 and %d\n", MAX_SHARDS);
+        return -1;
+    }
+    if (alerts.hysteresis < 0 || alerts.interval < 0) {
+        printf("Invalid arguments: hysteresis and re-alert interval must be >= 0\n");
+        return -1;
+    }
+    if (anomalies.sigma < 0 || anomalies.flatline < 0 || anomalies.flatline == 1) {
+        printf("Invalid arguments: sigma must be >= 0 and the flatline length 0 (off) or >= 2\n");
+        return -1;
+    }
+    if (data_workers < 1 || data_workers > MAX_DATA_WORKERS) {
+        printf("Invalid arguments: data manager workers must be between 1 and %d\n", MAX_DATA_WORKERS);
+        return -1;
+    }
+    if (avg_window < 1 || avg_window > RUN_AVG_MAX_LENGTH) {
+        printf("Invalid arguments: the running average window must be between 1 and %d\n", RUN_AVG_MAX_LENGTH);
+        return -1;
+    }
+    if (buffer_options.capacity < 1 || buffer_options.low_watermark > buffer_options.high_watermark ||
+        buffer_options.high_watermark > buffer_options.capacity) {
+        printf("Invalid arguments: capacity must be > 0 and 0 <= low watermark <= high watermark <= capacity\n");
+        return -1;
+    }
+
+    // installed before forking, so the logging process also survives a Ctrl-C and logs until the pipe closes
+    struct sigaction shutdown_action = {.sa_handler = handle_shutdown_signal, .sa_flags = SA_RESTART};
+    sigemptyset(&shutdown_action.sa_mask);
+    sigaction(SIGINT, &shutdown_action, NULL);
+    sigaction(SIGTERM, &shutdown_action, NULL);
+    struct sigaction reload_action = {.sa_handler = handle_reload_signal, .sa_flags = SA_RESTART};
+    sigemptyset(&reload_action.sa_mask);
+    sigaction(SIGHUP, &reload_action, NULL);
 
     if (create_log_process() != 0) {
         printf("Failed to create logging process\n");
@@ -65,23 +349,84 @@ int main(int argc, char *argv[]) {
     }
     write_to_log_process("Started the gateway");
 
-    sbuffer_t *shared_buffer = NULL;
-    if (sbuffer_init(&shared_buffer) != SBUFFER_SUCCESS) {
+    sbuffer_shards_t *shared_buffers = NULL;
+    if (sbuffer_shards_init(&shared_buffers, shard_count, &buffer_options) != SBUFFER_SUCCESS) {
         write_to_log_process("Failed to initialize shared buffer");
         end_log_process();
         return -1;
     }
+    //several workers per shard: each one gets a partition buffer with only the sensors it owns
+    if (sbuffer_shards_partition(shared_buffers, data_workers, &buffer_options) != SBUFFER_SUCCESS) {
+        write_to_log_process("Failed to initialize the partition buffers");
+        sbuffer_shards_free(&shared_buffers);
+        end_log_process();
+        return -1;
+    }
 
     connection_manager_arguments_t *conn_params = malloc(sizeof(connection_manager_arguments_t));
-    datamanager_arguments_t *data_params = malloc(sizeof(datamanager_arguments_t));
-    storagemanager_arguments_t *storage_params = malloc(sizeof(storagemanager_arguments_t));
-
-    if (!conn_params || !data_params || !storage_params) {
+    int data_count = shard_count * data_workers;
+    datamanager_arguments_t *data_params = malloc(sizeof(datamanager_arguments_t) * data_count);
+    storagemanager_arguments_t *storage_params = malloc(sizeof(storagemanager_arguments_t) * shard_count);
+    pthread_t *datamgr_threads = malloc(sizeof(pthread_t) * data_count);
+    pthread_t *storagemgr_threads = malloc(sizeof(pthread_t) * shard_count);
+    rollup_arguments_t *rollup_params = malloc(sizeof(rollup_arguments_t) * shard_count);
+    pthread_t *rollup_threads = malloc(sizeof(pthread_t) * shard_count);
+
+    if (!conn_params || !data_params || !storage_params || !datamgr_threads || !storagemgr_threads ||
+        !rollup_params || !rollup_threads) {
         write_to_log_process("Failed to allocate thread parameters");
         free(conn_params);
         free(data_params);
         free(storage_params);
-        sbuffer_free(&shared_buffer);
+        free(datamgr_threads);
+        free(storagemgr_threads);
+        free(rollup_params);
+        free(rollup_threads);
+        sbuffer_shards_free(&shared_buffers);
+        end_log_process();
+        return -1;
+    }
+
+    //the rollup files are opened before the rollup stage exists, a stage that cannot write never holds up a buffer
+    bool rollups_opened = true;
+    for (int i = 0; i < shard_count; i++) {
+        rollup_params[i].resolution_count = rollup_count;
+        memcpy(rollup_params[i].resolutions, rollup_resolutions, sizeof(int) * rollup_count);
+        if (rollups_opened && rollup_open_files(&rollup_params[i]) != 0) {
+            rollups_opened = false;
+            for (int j = 0; j < i; j++) rollup_close_files(&rollup_params[j]);
+        }
+    }
+    if (!rollups_opened) {
+        write_to_log_process("Failed to open the rollup files");
+        free(conn_params);
+        free(data_params);
+        free(storage_params);
+        free(datamgr_threads);
+        free(storagemgr_threads);
+        free(rollup_params);
+        free(rollup_threads);
+        sbuffer_shards_free(&shared_buffers);
+        end_log_process();
+        return -1;
+    }
+
+    //every shard gets its own data manager workers and storage manager, registered as consumers before any data flows
+    //each worker reads the partition buffer of its shard, which only gets the sensors of its partition
+    int data_stage = sbuffer_shards_register_partition_stage(shared_buffers, "data manager");
+    int storage_stage = sbuffer_shards_register_stage(shared_buffers, "storage manager");
+    int rollup_stage = (rollup_count > 0) ? sbuffer_shards_register_stage(shared_buffers, "rollup") : 0;
+    if (data_stage == SBUFFER_FAILURE || storage_stage == SBUFFER_FAILURE || rollup_stage == SBUFFER_FAILURE) {
+        write_to_log_process("Failed to register the pipeline stages");
+        for (int i = 0; i < shard_count; i++) rollup_close_files(&rollup_params[i]);
+        free(conn_params);
+        free(data_params);
+        free(storage_params);
+        free(datamgr_threads);
+        free(storagemgr_threads);
+        free(rollup_params);
+        free(rollup_threads);
+        sbuffer_shards_free(&shared_buffers);
         end_log_process();
         return -1;
     }
@@ -89,42 +434,98 @@ int main(int argc, char *argv[]) {
     //shared param setup
     conn_params->port = tcp_port;
     conn_params->max_con = max_conn;
-    conn_params->sBuffer = shared_buffer;
-    data_params->sBuffer = shared_buffer;
-    storage_params->sBuffer = shared_buffer;
+    conn_params->sBuffers = shared_buffers;
+    conn_params->mode = conn_mode;
+    conn_params->io_threads = io_threads;
+    conn_params->long_running = long_running;
+    conn_params->listeners = listeners;
+    conn_params->listener_shards = listener_shards;
+    conn_params->udp_port = udp_port;
+    for (int i = 0; i < shard_count; i++) {
+        for (int w = 0; w < data_workers; w++) {
+            datamanager_arguments_t *worker = &data_params[i * data_workers + w];
+            worker->sBuffer = sbuffer_partition_at(shared_buffers, i, w);
+            worker->stage_id = data_stage;
+            worker->window = avg_window;
+            worker->worker = w;
+            worker->workers = data_workers;
+            worker->shard = i;
+            worker->shards = shard_count;
+            worker->any_shard = listener_shards;
+            worker->alerts = alerts;
+            worker->anomalies = anomalies;
+        }
+        storage_params[i].sBuffer = sbuffer_shard_at(shared_buffers, i);
+        storage_params[i].stage_id = storage_stage;
+        rollup_params[i].sBuffer = sbuffer_shard_at(shared_buffers, i);
+        rollup_params[i].stage_id = rollup_stage;
+    }
 
     char log_message[300];
-    snprintf(log_message, sizeof(log_message), "Initializing with port %d and max connections %d", tcp_port, max_conn);
+    snprintf(log_message, sizeof(log_message), "Initializing with port %d, max connections %d, %d shard(s) and %d data manager worker(s) per shard",
+             tcp_port, max_conn, shard_count, data_workers);
     write_to_log_process(log_message);
 
-    pthread_t connmgr_thread, datamgr_thread, storagemgr_thread;
+    pthread_t connmgr_thread;
     increment_active_threads(); // connection manager
-    increment_active_threads(); // data manager
-    increment_active_threads(); // storage manager
+    bool threads_created = pthread_create(&connmgr_thread, NULL, connection_manager, conn_params) == 0;
+    for (int i = 0; i < data_count && threads_created; i++) {
+        increment_active_threads(); // data manager worker
+        threads_created = pthread_create(&datamgr_threads[i], NULL, data_manager, &data_params[i]) == 0;
+    }
+    for (int i = 0; i < shard_count && threads_created; i++) {
+        increment_active_threads(); // storage manager
+        threads_created = pthread_create(&storagemgr_threads[i], NULL, storage_manager, &storage_params[i]) == 0;
+    }
+    for (int i = 0; i < shard_count && rollup_count > 0 && threads_created; i++) {
+        increment_active_threads(); // rollup stage
+        threads_created = pthread_create(&rollup_threads[i], NULL, rollup_manager, &rollup_params[i]) == 0;
+    }
 
-    if (pthread_create(&connmgr_thread, NULL, connection_manager, conn_params) != 0 ||
-        pthread_create(&datamgr_thread, NULL, data_manager, data_params) != 0 ||
-        pthread_create(&storagemgr_thread, NULL, storage_manager, storage_params) != 0) {
+    if (!threads_created) {
         write_to_log_process("Failed to create one or more threads");
         free(conn_params);
         free(data_params);
         free(storage_params);
-        sbuffer_free(&shared_buffer);
+        free(datamgr_threads);
+        free(storagemgr_threads);
+        free(rollup_params);
+        free(rollup_threads);
+        sbuffer_shards_free(&shared_buffers);
         end_log_process();
         return -1;
     }
 
+    //the room map can change while the gateway runs, a failing watcher only costs the hot reload
+    map_watcher_arguments_t watcher_params = {.stop = false};
+    pthread_t watcher_thread;
+    bool watcher_started = pthread_create(&watcher_thread, NULL, map_watcher, &watcher_params) == 0;
+    if (!watcher_started) write_to_log_process("Failed to start the sensor map watcher, the map will not be reloaded");
+
     pthread_join(connmgr_thread, NULL);
     write_to_log_process("Connection manager thread completed");
     decrement_active_threads();
 
-    pthread_join(datamgr_thread, NULL);
-    write_to_log_process("Data manager thread completed");
-    decrement_active_threads();
-
-    pthread_join(storagemgr_thread, NULL);
-    write_to_log_process("Storage manager thread completed");
-    decrement_active_threads();
+    for (int i = 0; i < data_count; i++) {
+        pthread_join(datamgr_threads[i], NULL);
+        write_to_log_process("Data manager thread completed");
+        decrement_active_threads();
+    }
+    for (int i = 0; i < shard_count; i++) {
+        pthread_join(storagemgr_threads[i], NULL);
+        write_to_log_process("Storage manager thread completed");
+        decrement_active_threads();
+    }
+    for (int i = 0; i < shard_count && rollup_count > 0; i++) {
+        pthread_join(rollup_threads[i], NULL);
+        write_to_log_process("Rollup thread completed");
+        decrement_active_threads();
+    }
+    if (watcher_started) {
+        atomic_store(&watcher_params.stop, true);
+        pthread_join(watcher_thread, NULL);
+    }
+    datamgr_free_map();
 
     // Wait for all threads to complete cleanly
     pthread_mutex_lock(&shutdown_mutex);
@@ -134,11 +535,16 @@ int main(int argc, char *argv[]) {
     pthread_mutex_unlock(&shutdown_mutex);
 
     // Final cleanup
+    log_buffer_stats(shared_buffers);
     write_to_log_process("Gateway shutting down");
     free(conn_params);
     free(data_params);
     free(storage_params);
-    sbuffer_free(&shared_buffer);
+    free(datamgr_threads);
+    free(storagemgr_threads);
+    free(rollup_params);
+    free(rollup_threads);
+    sbuffer_shards_free(&shared_buffers);
     end_log_process();
 
     pthread_mutex_destroy(&shutdown_mutex);
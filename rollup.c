@@ -0,0 +1,231 @@
+//
+// Created by sodir on 10/17/26.
+//
+
+#include "rollup.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * the open window of one sensor at one resolution
+ */
+typedef struct rollup_window {
+    time_t start;                   /**< first second of the window */
+    time_t closed;                  /**< end of the latest window written, earlier readings are late */
+    uint32_t count;                 /**< readings in the window, 0 if no window is open */
+    sensor_value_t sum;
+    sensor_value_t min;
+    sensor_value_t max;
+    time_t first;                   /**< timestamp of the first and the last reading in the window */
+    time_t last;
+} rollup_window_t;
+
+typedef struct rollup_sensor {
+    sensor_id_t sensor_id;
+    rollup_window_t windows[ROLLUP_MAX_RESOLUTIONS];
+} rollup_sensor_t;
+
+/**
+ * the windows of every sensor the stage has seen, stored contiguously and indexed by sensor id
+ */
+typedef struct rollup_table {
+    rollup_sensor_t *sensors;
+    int count;
+    int capacity;
+    uint16_t index[SENSOR_ID_COUNT];    /**< position + 1 of every sensor id in 'sensors', 0 if not seen yet */
+} rollup_table_t;
+
+typedef struct rollup_stage {
+    rollup_table_t *table;
+    int resolutions[ROLLUP_MAX_RESOLUTIONS];
+    int resolution_count;
+    FILE *files[ROLLUP_MAX_RESOLUTIONS];
+    time_t latest;                          /**< latest reading timestamp of the shard */
+    time_t next_sweep[ROLLUP_MAX_RESOLUTIONS];  /**< 'latest' at which the windows of silent sensors are closed */
+    uint64_t written;
+    uint64_t late;
+} rollup_stage_t;
+
+static rollup_sensor_t *rollup_sensor(rollup_table_t *table, sensor_id_t sensor_id) {
+    uint16_t position = table->index[sensor_id];
+    if (position != 0) return &table->sensors[position - 1];
+
+    // every sensor id but 0 maps to one position, so a position + 1 always fits in the index
+    if (table->count == table->capacity) {
+        int capacity = (table->capacity == 0) ? 64 : table->capacity * 2;
+        rollup_sensor_t *sensors = realloc(table->sensors, sizeof(rollup_sensor_t) * capacity);
+        if (!sensors) return NULL;
+        table->sensors = sensors;
+        table->capacity = capacity;
+    }
+    rollup_sensor_t *sensor = &table->sensors[table->count++];
+    memset(sensor, 0, sizeof(*sensor));
+    sensor->sensor_id = sensor_id;
+    table->index[sensor_id] = (uint16_t)table->count;
+    return sensor;
+}
+
+static void write_window(rollup_stage_t *stage, int resolution, sensor_id_t sensor_id, rollup_window_t *window) {
+    time_t end = window->start + stage->resolutions[resolution];
+    if (fprintf(stage->files[resolution], "%d,%ld,%ld,%u,%.2f,%.2f,%.2f,%ld,%ld\n",
+                sensor_id, (long)window->start, (long)end, window->count, window->sum, window->min, window->max,
+                (long)window->first, (long)window->last) < 0) {
+        write_to_log_process("Failed to write a rollup window");
+    } else {
+        stage->written++;
+    }
+    window->closed = end;
+    window->count = 0;
+}
+
+static void rollup_add(rollup_stage_t *stage, rollup_sensor_t *sensor, sensor_data_t *data) {
+    for (int r = 0; r < stage->resolution_count; r++) {
+        rollup_window_t *window = &sensor->windows[r];
+        if (data->ts < window->closed) {
+            stage->late++;
+            continue;
+        }
+        time_t start = data->ts - data->ts % stage->resolutions[r];
+        if (window->count > 0 && start != window->start) {
+            if (start < window->start) {
+                // earlier than the open window but later than the written one, the reading is late all the same
+                stage->late++;
+                continue;
+            }
+            write_window(stage, r, sensor->sensor_id, window);
+        }
+
+        if (window->count == 0) {
+            window->start = start;
+            window->sum = 0;
+            window->min = data->value;
+            window->max = data->value;
+            window->first = data->ts;
+            window->last = data->ts;
+        }
+        window->count++;
+        window->sum += data->value;
+        if (data->value < window->min) window->min = data->value;
+        if (data->value > window->max) window->max = data->value;
+        if (data->ts < window->first) window->first = data->ts;
+        if (data->ts > window->last) window->last = data->ts;
+    }
+}
+
+/**
+ * Writes the windows at resolution 'r' that ended at least ROLLUP_GRACE seconds before the latest reading,
+ * their sensors went silent
+ */
+static void rollup_sweep(rollup_stage_t *stage, int r) {
+    time_t horizon = stage->latest - ROLLUP_GRACE;
+    for (int i = 0; i < stage->table->count; i++) {
+        rollup_sensor_t *sensor = &stage->table->sensors[i];
+        rollup_window_t *window = &sensor->windows[r];
+        if (window->count > 0 && window->start + stage->resolutions[r] <= horizon) {
+            write_window(stage, r, sensor->sensor_id, window);
+        }
+    }
+    // once per window length: the next sweep is due when the windows open now have ended
+    stage->next_sweep[r] = horizon - horizon % stage->resolutions[r] + stage->resolutions[r] + ROLLUP_GRACE;
+}
+
+int rollup_open_files(rollup_arguments_t *params) {
+    for (int r = 0; r < params->resolution_count; r++) {
+        char filename[64];
+        snprintf(filename, sizeof(filename), ROLLUP_FILE_FORMAT, params->resolutions[r]);
+        // append mode and a write per line, so the stages of all shards can share a file
+        params->files[r] = fopen(filename, "a");
+        if (!params->files[r]) {
+            rollup_close_files(params);
+            return -1;
+        }
+        setvbuf(params->files[r], NULL, _IOLBF, 0);
+    }
+    return 0;
+}
+
+void rollup_close_files(rollup_arguments_t *params) {
+    for (int r = 0; r < params->resolution_count; r++) {
+        if (params->files[r]) fclose(params->files[r]);
+        params->files[r] = NULL;
+    }
+}
+
+/**
+ * Takes over the files of 'params'
+ * \return 0 on success, -1 on memory error
+ */
+static int rollup_open(rollup_stage_t *stage, rollup_arguments_t *params) {
+    stage->resolution_count = params->resolution_count;
+    for (int r = 0; r < stage->resolution_count; r++) {
+        stage->resolutions[r] = params->resolutions[r];
+        stage->files[r] = params->files[r];
+        params->files[r] = NULL;
+    }
+    stage->table = calloc(1, sizeof(rollup_table_t));
+    return stage->table ? 0 : -1;
+}
+
+static void rollup_close(rollup_stage_t *stage) {
+    for (int r = 0; r < stage->resolution_count; r++) {
+        if (stage->files[r]) fclose(stage->files[r]);
+    }
+    if (stage->table) free(stage->table->sensors);
+    free(stage->table);
+}
+
+void *rollup_manager(void *args) {
+    rollup_arguments_t *params = (rollup_arguments_t*)args;
+    rollup_stage_t stage = {0};
+    sensor_data_t batch[SBUFFER_BATCH_SIZE];
+    int count;
+
+    if (rollup_open(&stage, params) != 0) {
+        write_to_log_process("Failed to allocate the rollup windows, the rollup stage stops");
+        // otherwise the buffer keeps every record for this stage and fills up
+        sbuffer_unregister_stage(params->sBuffer, params->stage_id);
+        rollup_close(&stage);
+        return NULL;
+    }
+    write_to_log_process("Rollup stage initialized");
+
+    while (1) {
+        int result = sbuffer_read_batch(params->sBuffer, batch, SBUFFER_BATCH_SIZE, &count, params->stage_id);
+        if (result == SBUFFER_NO_DATA) break;
+        if (result != SBUFFER_SUCCESS) {
+            write_to_log_process("Error reading from buffer in rollup stage");
+            sbuffer_unregister_stage(params->sBuffer, params->stage_id);
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            rollup_sensor_t *sensor = rollup_sensor(stage.table, batch[i].id);
+            if (!sensor) {
+                write_to_log_process("Failed to allocate rollup windows");
+                continue;
+            }
+            rollup_add(&stage, sensor, &batch[i]);
+            if (batch[i].ts > stage.latest) stage.latest = batch[i].ts;
+        }
+        for (int r = 0; r < stage.resolution_count; r++) {
+            if (stage.latest >= stage.next_sweep[r]) rollup_sweep(&stage, r);
+        }
+    }
+
+    // the end marker: whatever is still open is all there will be
+    for (int i = 0; i < stage.table->count; i++) {
+        for (int r = 0; r < stage.resolution_count; r++) {
+            rollup_sensor_t *sensor = &stage.table->sensors[i];
+            if (sensor->windows[r].count > 0) write_window(&stage, r, sensor->sensor_id, &sensor->windows[r]);
+        }
+    }
+
+    char log_message[LOG_MSG_MAX_LEN];
+    snprintf(log_message, sizeof(log_message), "Rollup stage: %lu windows written, %lu late readings dropped",
+             (unsigned long)stage.written, (unsigned long)stage.late);
+    write_to_log_process(log_message);
+    rollup_close(&stage);
+    write_to_log_process("Rollup stage shutting down");
+    return NULL;
+}
@@ -0,0 +1,40 @@
+//
+// Created by sodir on 10/17/26.
+//
+
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include "config.h"
+#include "sbuffer.h"
+
+/**
+ * Thread function of the rollup stage, one per shared buffer next to the storage manager
+ * - Keeps a tumbling window per sensor and resolution: reading count, sum, min, max, first and last timestamp
+ * - Windows are aligned to multiples of their length on the reading timestamps, so the rows of all shards line up
+ * - Writes every closed window as a row "sensor_id,start,end,count,sum,min,max,first_ts,last_ts"
+ *   to ROLLUP_FILE_FORMAT, one file per resolution shared by all shards
+ * - A window closes at the first reading of its sensor after it, or once the latest reading of the shard is
+ *   ROLLUP_GRACE seconds past its end; readings for a window that was written already are dropped and counted
+ * - Writes the windows that are still open when the end marker arrives
+ * @param args Pointer to the rollup parameters (rollup_arguments_t)
+ * @return NULL on completion, all error handling done via logging
+ */
+void *rollup_manager(void *args);
+
+/**
+ * Opens the ROLLUP_FILE_FORMAT file of every resolution in 'params' for one rollup stage, in append mode and
+ * line buffered, so the stages of all shards can share a file. Called before the stage is registered:
+ * a stage that cannot write does not hold up the shared buffer.
+ * @param params the rollup parameters, 'resolutions' and 'resolution_count' are set
+ * @return 0 on success, -1 if a file could not be opened, the files that were opened are closed again
+ */
+int rollup_open_files(rollup_arguments_t *params);
+
+/**
+ * Closes the files of a rollup stage that will not run
+ * @param params the rollup parameters passed to rollup_open_files
+ */
+void rollup_close_files(rollup_arguments_t *params);
+
+#endif //ROLLUP_H
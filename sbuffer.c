@@ -3,150 +3,568 @@
 //
 #include "sbuffer.h"
 #include "config.h"
+#include <stdio.h>
+
+#define SBUFFER_CACHE_LINE 64
 
 /**
- * basic node for the buffer, these nodes are linked together to create the buffer
+ * a consumer of the buffer, registered with sbuffer_register_stage
  */
-typedef struct sbuffer_node {
-    struct sbuffer_node *next;
-    sensor_data_t data;
-    int processed_stages;
-} sbuffer_node_t;
+typedef struct {
+    uint64_t cursor;                        /**< sequence of the next record this stage will read */
+    pthread_cond_t dataAvailable;           /**< signalled when a record is inserted while this stage waits */
+    uint64_t records_read;                  /**< lag metrics, see sbuffer_stage_stats_t */
+    uint64_t max_lag;
+    char name[SBUFFER_STAGE_NAME_LEN];
+} sbuffer_stage_t;
 
 /**
  * a structure to keep track of the buffer
+    The buffer is a preallocated ring with a power of two number of slots. Records get an ever
+    increasing sequence number, slot = sequence & mask. Every stage has its own read cursor (the
+    next sequence it will read), so a fast stage never waits for a slow one. A slot is only reused
+    once every stage has moved its cursor past it (Disruptor style).
+    At most 'capacity' records are kept, what happens to a record that does not fit depends on 'policy'.
     We will use mutex locks with condition variables.
     Each time we lock before we get to the critical section
  */
 struct sbuffer {
-    sbuffer_node_t *head;       /**< a pointer to the first node in the buffer */
-    sbuffer_node_t *tail;       /**< a pointer to the last node in the buffer */
+    sensor_data_t *slots;                   /**< the ring itself, allocated once in sbuffer_init */
+    uint64_t mask;                          /**< ring size - 1, used to map a sequence to a slot */
+    uint64_t head;                          /**< sequence of the next record that will be inserted */
+    sbuffer_stage_t stages[SBUFFER_MAX_STAGES]; /**< registered consumers, each with its own cursor */
+    uint32_t stage_mask;                    /**< bit i set when stage i + 1 is registered */
+    uint32_t waiting_mask;                  /**< bit i set while stage i + 1 waits for data */
+    uint64_t capacity;                      /**< max records in the buffer, at most the ring size */
+    sbuffer_policy_t policy;                /**< what to do with a record when the buffer is full */
+    uint64_t high_watermark;                /**< at this size the buffer asks producers to back off */
+    uint64_t low_watermark;                 /**< at this size producers may continue again */
+    bool throttled;                         /**< true between crossing the high and the low watermark */
+    sbuffer_stats_t stats;                  /**< overload counters */
+    pthread_mutex_t bufferMutex;            /**< every buffer has its own lock, buffers never block each other */
+    pthread_cond_t stageComplete;           /**< signalled when the slowest stage frees a slot */
+};
+
+/**
+ * a set of independent buffers, records are routed to a shard by their sensor id
+ * so all readings of one sensor stay in order inside a single shard
+ * A partitioned set also copies every record into one partition buffer of its shard, picked by sbuffer_partition_of
+ */
+struct sbuffer_shards {
+    sbuffer_t **shards;
+    int count;
+    sbuffer_t **partitions;     /**< 'partition_count' buffers per shard, shard by shard, NULL if not partitioned */
+    int partition_count;
+    bool owner;                 /**< false for a view, which must not free the buffers */
 };
 
-pthread_mutex_t bufferMutex;
-pthread_cond_t dataAvailable;
-pthread_cond_t stageComplete;
+/**
+ * The oldest sequence that is still needed by at least one stage, everything before it can be overwritten
+ * Must be called with the buffer's bufferMutex locked
+ */
+static uint64_t sbuffer_tail(sbuffer_t *buffer) {
+    uint64_t tail = buffer->head;   // without stages nothing has to be kept
+    for (uint32_t m = buffer->stage_mask; m; m &= m - 1) {
+        uint64_t cursor = buffer->stages[__builtin_ctz(m)].cursor;
+        if (cursor < tail) tail = cursor;
+    }
+    return tail;
+}
+
+/**
+ * Wakes up only the stages that are waiting for data, instead of every reader of the buffer
+ * Must be called with the buffer's bufferMutex locked
+ */
+static void sbuffer_signal_stages(sbuffer_t *buffer) {
+    for (uint32_t m = buffer->waiting_mask; m; m &= m - 1) {
+        pthread_cond_signal(&buffer->stages[__builtin_ctz(m)].dataAvailable);
+    }
+}
+
+/**
+ * Drops the oldest record for every stage that did not read it yet, so its slot can be reused
+ * Must be called with the buffer's bufferMutex locked
+ */
+static void sbuffer_drop_oldest(sbuffer_t *buffer) {
+    uint64_t tail = sbuffer_tail(buffer);
+    for (uint32_t m = buffer->stage_mask; m; m &= m - 1) {
+        sbuffer_stage_t *stage = &buffer->stages[__builtin_ctz(m)];
+        if (stage->cursor == tail) stage->cursor++;
+    }
+    buffer->stats.dropped_oldest++;
+}
+
+void sbuffer_default_options(sbuffer_options_t *options) {
+    options->capacity = SBUFFER_CAPACITY;
+    options->policy = SBUFFER_POLICY_BLOCK;
+    options->high_watermark = SBUFFER_CAPACITY * SBUFFER_HIGH_WATERMARK / 100;
+    options->low_watermark = SBUFFER_CAPACITY * SBUFFER_LOW_WATERMARK / 100;
+}
 
 int sbuffer_init(sbuffer_t **buffer) {
+    sbuffer_options_t options;
+    sbuffer_default_options(&options);
+    return sbuffer_init_with_options(buffer, &options);
+}
+
+int sbuffer_init_with_options(sbuffer_t **buffer, const sbuffer_options_t *options) {
+    if (buffer == NULL || options == NULL || options->capacity < 1) return SBUFFER_FAILURE;
+    if (options->low_watermark > options->high_watermark || options->high_watermark > options->capacity) {
+        return SBUFFER_FAILURE;
+    }
+
     *buffer = malloc(sizeof(sbuffer_t));
     if (*buffer == NULL) return SBUFFER_FAILURE;
-    (*buffer)->head = NULL;
-    (*buffer)->tail = NULL;
 
-    pthread_mutex_init(&bufferMutex, NULL);
-    pthread_cond_init(&dataAvailable, NULL);
-    pthread_cond_init(&stageComplete, NULL);
+    //round the ring up to a power of two so a sequence maps to a slot with a mask
+    uint64_t ring_size = 1;
+    while (ring_size < (uint64_t)options->capacity) ring_size <<= 1;
+
+    //the ring is the only memory the buffer ever uses: allocate it cache line aligned and touch every page
+    //now, so neither malloc nor first-touch page faults ever happen inside the critical section
+    size_t ring_bytes = sizeof(sensor_data_t) * ring_size;
+    ring_bytes = (ring_bytes + SBUFFER_CACHE_LINE - 1) / SBUFFER_CACHE_LINE * SBUFFER_CACHE_LINE;
+    (*buffer)->slots = aligned_alloc(SBUFFER_CACHE_LINE, ring_bytes);
+    if ((*buffer)->slots == NULL) {
+        free(*buffer);
+        *buffer = NULL;
+        return SBUFFER_FAILURE;
+    }
+    memset((*buffer)->slots, 0, ring_bytes);
+    (*buffer)->mask = ring_size - 1;
+    (*buffer)->head = 0;
+    (*buffer)->stage_mask = 0;
+    (*buffer)->waiting_mask = 0;
+    (*buffer)->capacity = options->capacity;
+    (*buffer)->policy = options->policy;
+    (*buffer)->high_watermark = options->high_watermark;
+    (*buffer)->low_watermark = options->low_watermark;
+    (*buffer)->throttled = false;
+    memset(&(*buffer)->stats, 0, sizeof((*buffer)->stats));
+
+    if (pthread_mutex_init(&(*buffer)->bufferMutex, NULL) != 0) {
+        free((*buffer)->slots);
+        free(*buffer);
+        *buffer = NULL;
+        return SBUFFER_FAILURE;
+    }
+    if (pthread_cond_init(&(*buffer)->stageComplete, NULL) != 0) {
+        pthread_mutex_destroy(&(*buffer)->bufferMutex);
+        free((*buffer)->slots);
+        free(*buffer);
+        *buffer = NULL;
+        return SBUFFER_FAILURE;
+    }
 
     return SBUFFER_SUCCESS;
 }
 
 int sbuffer_free(sbuffer_t **buffer) {
-    pthread_mutex_lock(&bufferMutex);
     if ((buffer == NULL) || (*buffer == NULL)) {
-        pthread_mutex_unlock(&bufferMutex);
         return SBUFFER_FAILURE;
     }
 
-    while ((*buffer)->head) {
-        sbuffer_node_t *dummy = (*buffer)->head;
-        (*buffer)->head = (*buffer)->head->next;
-        free(dummy);
+    for (uint32_t m = (*buffer)->stage_mask; m; m &= m - 1) {
+        pthread_cond_destroy(&(*buffer)->stages[__builtin_ctz(m)].dataAvailable);
     }
-    pthread_mutex_unlock(&bufferMutex);
-
-    pthread_cond_destroy(&dataAvailable);
-    pthread_mutex_destroy(&bufferMutex);
-    pthread_cond_destroy(&stageComplete);
+    pthread_mutex_destroy(&(*buffer)->bufferMutex);
+    pthread_cond_destroy(&(*buffer)->stageComplete);
 
+    free((*buffer)->slots);
     free(*buffer);
     *buffer = NULL;
     return SBUFFER_SUCCESS;
 }
 
-int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data) {
+int sbuffer_register_stage(sbuffer_t *buffer, const char *name) {
     if (buffer == NULL) return SBUFFER_FAILURE;
-    pthread_mutex_lock(&bufferMutex);
+    pthread_mutex_lock(&buffer->bufferMutex);
 
-    sbuffer_node_t *node = malloc(sizeof(sbuffer_node_t));
-    if (node == NULL) return SBUFFER_FAILURE;
+    int index = 0;
+    while (index < SBUFFER_MAX_STAGES && (buffer->stage_mask & (1u << index))) index++;
+    if (index == SBUFFER_MAX_STAGES) {
+        pthread_mutex_unlock(&buffer->bufferMutex);
+        return SBUFFER_FAILURE;
+    }
 
-    node->data = *data;
-    node->next = NULL;
-    node->processed_stages = 0; //set stages, better than enums
+    sbuffer_stage_t *stage = &buffer->stages[index];
+    if (pthread_cond_init(&stage->dataAvailable, NULL) != 0) {
+        pthread_mutex_unlock(&buffer->bufferMutex);
+        return SBUFFER_FAILURE;
+    }
+    //a stage only sees records inserted after its registration
+    stage->cursor = buffer->head;
+    stage->records_read = 0;
+    stage->max_lag = 0;
+    snprintf(stage->name, sizeof(stage->name), "%s", name ? name : "stage");
+    buffer->stage_mask |= 1u << index;
+
+    pthread_mutex_unlock(&buffer->bufferMutex);
+    return index + 1;
+}
 
+int sbuffer_unregister_stage(sbuffer_t *buffer, int stage_id) {
+    if (buffer == NULL || stage_id < 1 || stage_id > SBUFFER_MAX_STAGES) return SBUFFER_FAILURE;
+    uint32_t stage_bit = 1u << (stage_id - 1);
+    pthread_mutex_lock(&buffer->bufferMutex);
+    if (!(buffer->stage_mask & stage_bit)) {
+        pthread_mutex_unlock(&buffer->bufferMutex);
+        return SBUFFER_FAILURE;
+    }
 
-    if (buffer->tail == NULL) {
-        buffer->head = buffer->tail = node;
-    } else {
-        buffer->tail->next = node;
-        buffer->tail = node;
+    buffer->stage_mask &= ~stage_bit;
+    buffer->waiting_mask &= ~stage_bit;
+    pthread_cond_destroy(&buffer->stages[stage_id - 1].dataAvailable);
+    //the stage may have been the slowest one: its slots are free now
+    if (buffer->throttled && buffer->head - sbuffer_tail(buffer) <= buffer->low_watermark) {
+        buffer->throttled = false;
     }
+    pthread_cond_broadcast(&buffer->stageComplete);
+    pthread_mutex_unlock(&buffer->bufferMutex);
+    return SBUFFER_SUCCESS;
+}
 
-    pthread_cond_broadcast(&dataAvailable);
-    pthread_mutex_unlock(&bufferMutex);
+int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data) {
+    return sbuffer_insert_batch(buffer, data, 1);
+}
 
-    return SBUFFER_SUCCESS;
+int sbuffer_insert_batch(sbuffer_t *buffer, sensor_data_t *data, int count) {
+    if (buffer == NULL || data == NULL || count < 0) return SBUFFER_FAILURE;
+    if (count == 0) return SBUFFER_SUCCESS;
+    pthread_mutex_lock(&buffer->bufferMutex);
+
+    int result = SBUFFER_SUCCESS;
+    int inserted = 0;
+    while (inserted < count) {
+        if (buffer->head - sbuffer_tail(buffer) >= buffer->capacity) {
+            // the end marker is never dropped, otherwise the stages would never stop
+            sbuffer_policy_t policy = (data[inserted].id == 0) ? SBUFFER_POLICY_BLOCK : buffer->policy;
+            if (policy == SBUFFER_POLICY_DROP_NEWEST) {
+                buffer->stats.dropped_newest += count - inserted;
+                break;
+            }
+            if (policy == SBUFFER_POLICY_REJECT) {
+                buffer->stats.rejected += count - inserted;
+                result = SBUFFER_FULL;
+                break;
+            }
+            if (policy == SBUFFER_POLICY_DROP_OLDEST) {
+                sbuffer_drop_oldest(buffer);
+            } else {
+                //let the readers at what we already copied and wait until the slowest stage frees a slot
+                sbuffer_signal_stages(buffer);
+                pthread_cond_wait(&buffer->stageComplete, &buffer->bufferMutex);
+                continue;
+            }
+        }
+
+        buffer->slots[buffer->head & buffer->mask] = data[inserted++];
+        buffer->head++;
+        buffer->stats.inserted++;
+    }
+
+    if (!buffer->throttled && buffer->head - sbuffer_tail(buffer) >= buffer->high_watermark) {
+        buffer->throttled = true;
+    }
+
+    sbuffer_signal_stages(buffer);
+    pthread_mutex_unlock(&buffer->bufferMutex);
+
+    return result;
 }
 
 int sbuffer_read(sbuffer_t *buffer, sensor_data_t *data, int stage_id) {
-    pthread_mutex_lock(&bufferMutex);
+    int count;
+    return sbuffer_read_batch(buffer, data, 1, &count, stage_id);
+}
 
-    while (1) {
-        if (buffer->head == NULL) {
-            pthread_cond_wait(&dataAvailable, &bufferMutex);
-            continue;
-        }
+int sbuffer_read_batch(sbuffer_t *buffer, sensor_data_t *data, int max_count, int *count, int stage_id) {
+    if (buffer == NULL || data == NULL || count == NULL || max_count < 1) return SBUFFER_FAILURE;
+    if (stage_id < 1 || stage_id > SBUFFER_MAX_STAGES) return SBUFFER_FAILURE;
+    uint32_t stage_bit = 1u << (stage_id - 1);
+    sbuffer_stage_t *stage = &buffer->stages[stage_id - 1];
+    uint64_t *cursor = &stage->cursor;
+    *count = 0;
+
+    pthread_mutex_lock(&buffer->bufferMutex);
+    if (!(buffer->stage_mask & stage_bit)) {
+        pthread_mutex_unlock(&buffer->bufferMutex);
+        return SBUFFER_FAILURE;
+    }
+
+    while (*cursor == buffer->head) {
+        buffer->waiting_mask |= stage_bit;
+        pthread_cond_wait(&stage->dataAvailable, &buffer->bufferMutex);
+    }
+    buffer->waiting_mask &= ~stage_bit;
 
-        // Check for end marker
-        if (buffer->head->data.id == 0) {
-            *data = buffer->head->data;
-            pthread_mutex_unlock(&bufferMutex);
-            return SBUFFER_NO_DATA;
+    if (buffer->head - *cursor > stage->max_lag) stage->max_lag = buffer->head - *cursor;
+
+    uint64_t old_tail = sbuffer_tail(buffer);
+    while (*count < max_count && *cursor != buffer->head) {
+        sensor_data_t *slot = &buffer->slots[*cursor & buffer->mask];
+        // end marker: stop in front of it, the cursor stays on it so every later read also sees it
+        if (slot->id == 0) break;
+        data[(*count)++] = *slot;
+        (*cursor)++;
+    }
+    stage->records_read += *count;
+
+    //only the slowest stage frees slots when it moves on
+    if (sbuffer_tail(buffer) != old_tail) {
+        if (buffer->throttled && buffer->head - sbuffer_tail(buffer) <= buffer->low_watermark) {
+            buffer->throttled = false;
         }
+        pthread_cond_broadcast(&buffer->stageComplete);
+    }
+    if (*count == 0) {
+        data[0] = buffer->slots[*cursor & buffer->mask];
+    }
+
+    pthread_mutex_unlock(&buffer->bufferMutex);
+    return *count > 0 ? SBUFFER_SUCCESS : SBUFFER_NO_DATA;
+}
 
-        //check if node already processed
-        int stage_bit = (1 << (stage_id - 1));
-        if (buffer->head->processed_stages & stage_bit) {
-            pthread_cond_wait(&dataAvailable, &bufferMutex);
-            continue;
+bool sbuffer_is_empty(sbuffer_t *buffer) {
+    if (!buffer) return true;
+
+    pthread_mutex_lock(&buffer->bufferMutex);
+    bool is_empty = (sbuffer_tail(buffer) == buffer->head);
+    pthread_mutex_unlock(&buffer->bufferMutex);
+
+    return is_empty;
+}
+
+int sbuffer_wait_below_watermark(sbuffer_t *buffer) {
+    if (buffer == NULL) return SBUFFER_FAILURE;
+
+    pthread_mutex_lock(&buffer->bufferMutex);
+    while (buffer->throttled) {
+        pthread_cond_wait(&buffer->stageComplete, &buffer->bufferMutex);
+    }
+    pthread_mutex_unlock(&buffer->bufferMutex);
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_get_stats(sbuffer_t *buffer, sbuffer_stats_t *stats) {
+    if (buffer == NULL || stats == NULL) return SBUFFER_FAILURE;
+
+    pthread_mutex_lock(&buffer->bufferMutex);
+    *stats = buffer->stats;
+    stats->size = buffer->head - sbuffer_tail(buffer);
+    stats->capacity = buffer->capacity;
+    pthread_mutex_unlock(&buffer->bufferMutex);
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_get_stage_stats(sbuffer_t *buffer, int stage_id, sbuffer_stage_stats_t *stats) {
+    if (buffer == NULL || stats == NULL || stage_id < 1 || stage_id > SBUFFER_MAX_STAGES) return SBUFFER_FAILURE;
+
+    pthread_mutex_lock(&buffer->bufferMutex);
+    if (!(buffer->stage_mask & (1u << (stage_id - 1)))) {
+        pthread_mutex_unlock(&buffer->bufferMutex);
+        return SBUFFER_FAILURE;
+    }
+    sbuffer_stage_t *stage = &buffer->stages[stage_id - 1];
+    stats->name = stage->name;
+    stats->records_read = stage->records_read;
+    stats->lag = buffer->head - stage->cursor;
+    stats->max_lag = stage->max_lag;
+    pthread_mutex_unlock(&buffer->bufferMutex);
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_shards_register_stage(sbuffer_shards_t *shards, const char *name) {
+    if (shards == NULL) return SBUFFER_FAILURE;
+
+    //every shard gets the same registrations in the same order, so the stage id is the same everywhere
+    int stage_id = SBUFFER_FAILURE;
+    for (int i = 0; i < shards->count; i++) {
+        int id = sbuffer_register_stage(shards->shards[i], name);
+        if (id == SBUFFER_FAILURE || (i > 0 && id != stage_id)) return SBUFFER_FAILURE;
+        stage_id = id;
+    }
+    return stage_id;
+}
+
+int sbuffer_shards_init(sbuffer_shards_t **shards, int count, const sbuffer_options_t *options) {
+    if (shards == NULL || count < 1) return SBUFFER_FAILURE;
+    *shards = malloc(sizeof(sbuffer_shards_t));
+    if (*shards == NULL) return SBUFFER_FAILURE;
+
+    (*shards)->shards = calloc(count, sizeof(sbuffer_t *));
+    if ((*shards)->shards == NULL) {
+        free(*shards);
+        *shards = NULL;
+        return SBUFFER_FAILURE;
+    }
+    (*shards)->count = count;
+    (*shards)->partitions = NULL;
+    (*shards)->partition_count = 1;
+    (*shards)->owner = true;
+
+    for (int i = 0; i < count; i++) {
+        int result = options ? sbuffer_init_with_options(&(*shards)->shards[i], options)
+                             : sbuffer_init(&(*shards)->shards[i]);
+        if (result != SBUFFER_SUCCESS) {
+            sbuffer_shards_free(shards);
+            return SBUFFER_FAILURE;
         }
+    }
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_shards_free(sbuffer_shards_t **shards) {
+    if ((shards == NULL) || (*shards == NULL)) return SBUFFER_FAILURE;
 
-        *data = buffer->head->data;
-        buffer->head->processed_stages |= stage_bit;
+    for (int i = 0; (*shards)->owner && i < (*shards)->count; i++) {
+        if ((*shards)->shards[i]) sbuffer_free(&(*shards)->shards[i]);
+    }
+    for (int i = 0; (*shards)->owner && (*shards)->partitions && i < (*shards)->count * (*shards)->partition_count; i++) {
+        if ((*shards)->partitions[i]) sbuffer_free(&(*shards)->partitions[i]);
+    }
+    if ((*shards)->owner) free((*shards)->partitions);
+    free((*shards)->shards);
+    free(*shards);
+    *shards = NULL;
+    return SBUFFER_SUCCESS;
+}
 
-        pthread_cond_signal(&stageComplete);
-        pthread_mutex_unlock(&bufferMutex);
-        return SBUFFER_SUCCESS;
+int sbuffer_shards_view(sbuffer_shards_t **view, sbuffer_shards_t *shards, int index) {
+    sbuffer_t *buffer = sbuffer_shard_at(shards, index);
+    if (view == NULL || buffer == NULL) return SBUFFER_FAILURE;
+    *view = malloc(sizeof(sbuffer_shards_t));
+    if (*view == NULL) return SBUFFER_FAILURE;
+    (*view)->shards = malloc(sizeof(sbuffer_t *));
+    if ((*view)->shards == NULL) {
+        free(*view);
+        *view = NULL;
+        return SBUFFER_FAILURE;
     }
+    (*view)->shards[0] = buffer;
+    (*view)->count = 1;
+    (*view)->partitions = shards->partitions ? &shards->partitions[index * shards->partition_count] : NULL;
+    (*view)->partition_count = shards->partition_count;
+    (*view)->owner = false;
+    return SBUFFER_SUCCESS;
 }
 
-int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data) {
-    pthread_mutex_lock(&bufferMutex);
+int sbuffer_shards_partition(sbuffer_shards_t *shards, int partitions, const sbuffer_options_t *options) {
+    if (shards == NULL || !shards->owner || shards->partitions != NULL || partitions < 1) return SBUFFER_FAILURE;
+    if (partitions == 1) return SBUFFER_SUCCESS;
+
+    shards->partitions = calloc(shards->count * partitions, sizeof(sbuffer_t *));
+    if (shards->partitions == NULL) return SBUFFER_FAILURE;
+    shards->partition_count = partitions;
+    for (int i = 0; i < shards->count * partitions; i++) {
+        int result = options ? sbuffer_init_with_options(&shards->partitions[i], options)
+                             : sbuffer_init(&shards->partitions[i]);
+        if (result != SBUFFER_SUCCESS) return SBUFFER_FAILURE;  // sbuffer_shards_free frees what was allocated
+    }
+    return SBUFFER_SUCCESS;
+}
 
-    while (buffer->head == NULL || buffer->head->processed_stages != 3) {
-        pthread_cond_wait(&stageComplete, &bufferMutex);
+int sbuffer_shards_register_partition_stage(sbuffer_shards_t *shards, const char *name) {
+    if (shards == NULL) return SBUFFER_FAILURE;
+    if (shards->partitions == NULL) return sbuffer_shards_register_stage(shards, name);
+
+    int stage_id = SBUFFER_FAILURE;
+    for (int i = 0; i < shards->count * shards->partition_count; i++) {
+        int id = sbuffer_register_stage(shards->partitions[i], name);
+        if (id == SBUFFER_FAILURE || (i > 0 && id != stage_id)) return SBUFFER_FAILURE;
+        stage_id = id;
     }
+    return stage_id;
+}
+
+int sbuffer_shards_partition_count(sbuffer_shards_t *shards) {
+    return shards ? shards->partition_count : 0;
+}
 
-    *data = buffer->head->data;
-    sbuffer_node_t *temp = buffer->head;
-    buffer->head = buffer->head->next;
+sbuffer_t *sbuffer_partition_at(sbuffer_shards_t *shards, int index, int partition) {
+    if (shards == NULL || partition < 0 || partition >= shards->partition_count) return NULL;
+    if (shards->partitions == NULL) return sbuffer_shard_at(shards, index);
+    if (index < 0 || index >= shards->count) return NULL;
+    return shards->partitions[index * shards->partition_count + partition];
+}
+
+int sbuffer_partition_of(sensor_id_t id, int partitions) {
+    // multiplicative (Fibonacci) hashing, the shards already split the ids by their lowest bits
+    return (int)((((uint32_t)id * 2654435761u) >> 16) % (uint32_t)partitions);
+}
 
-    if (buffer->head == NULL) {
-        buffer->tail = NULL;
+/**
+ * Inserts 'count' records of shard 'shard' in its buffer and, for a partitioned set, each in its partition buffer too
+ * \return SBUFFER_SUCCESS on success, or the first failure of sbuffer_insert_batch
+ */
+static int sbuffer_shard_insert_batch(sbuffer_shards_t *shards, int shard, sensor_data_t *data, int count) {
+    int result = sbuffer_insert_batch(shards->shards[shard], data, count);
+    if (shards->partitions == NULL) return result;
+
+    sensor_data_t routed[SBUFFER_BATCH_SIZE];
+    sbuffer_t **partitions = &shards->partitions[shard * shards->partition_count];
+    for (int start = 0; start < count; start += SBUFFER_BATCH_SIZE) {
+        int end = (count - start > SBUFFER_BATCH_SIZE) ? start + SBUFFER_BATCH_SIZE : count;
+        for (int partition = 0; partition < shards->partition_count; partition++) {
+            int routed_count = 0;
+            for (int i = start; i < end; i++) {
+                if (sbuffer_partition_of(data[i].id, shards->partition_count) == partition) routed[routed_count++] = data[i];
+            }
+            int partition_result = sbuffer_insert_batch(partitions[partition], routed, routed_count);
+            if (partition_result != SBUFFER_SUCCESS && result == SBUFFER_SUCCESS) result = partition_result;
+        }
     }
+    return result;
+}
 
-    free(temp);
-    pthread_mutex_unlock(&bufferMutex);
+int sbuffer_shards_count(sbuffer_shards_t *shards) {
+    return shards ? shards->count : 0;
+}
 
-    return buffer->head == NULL? SBUFFER_NO_DATA : SBUFFER_SUCCESS;
+sbuffer_t *sbuffer_shard_at(sbuffer_shards_t *shards, int index) {
+    if (shards == NULL || index < 0 || index >= shards->count) return NULL;
+    return shards->shards[index];
 }
 
-bool sbuffer_is_empty(sbuffer_t *buffer) {
-    if (!buffer) return true;
+sbuffer_t *sbuffer_shard_for(sbuffer_shards_t *shards, sensor_id_t id) {
+    if (shards == NULL) return NULL;
+    return shards->shards[id % shards->count];
+}
 
-    pthread_mutex_lock(&bufferMutex);
-    bool is_empty = (buffer->head == NULL);
-    pthread_mutex_unlock(&bufferMutex);
+int sbuffer_shards_insert(sbuffer_shards_t *shards, sensor_data_t *data) {
+    if (shards == NULL || data == NULL) return SBUFFER_FAILURE;
 
-    return is_empty;
-}
\ No newline at end of file
+    //the end marker has to reach the stages of every shard and every partition
+    if (data->id == 0) {
+        int result = SBUFFER_SUCCESS;
+        for (int i = 0; i < shards->count; i++) {
+            if (sbuffer_insert(shards->shards[i], data) != SBUFFER_SUCCESS) result = SBUFFER_FAILURE;
+        }
+        for (int i = 0; shards->partitions && i < shards->count * shards->partition_count; i++) {
+            if (sbuffer_insert(shards->partitions[i], data) != SBUFFER_SUCCESS) result = SBUFFER_FAILURE;
+        }
+        return result;
+    }
+    return sbuffer_shard_insert_batch(shards, data->id % shards->count, data, 1);
+}
+
+int sbuffer_shards_insert_batch(sbuffer_shards_t *shards, sensor_data_t *data, int count) {
+    if (shards == NULL || data == NULL || count < 0) return SBUFFER_FAILURE;
+    if (shards->count == 1) return sbuffer_shard_insert_batch(shards, 0, data, count);
+
+    //split the batch per shard, keeping the order of the records inside every shard
+    sensor_data_t routed[SBUFFER_BATCH_SIZE];
+    int result = SBUFFER_SUCCESS;
+    for (int start = 0; start < count; start += SBUFFER_BATCH_SIZE) {
+        int end = (count - start > SBUFFER_BATCH_SIZE) ? start + SBUFFER_BATCH_SIZE : count;
+        for (int shard = 0; shard < shards->count; shard++) {
+            int routed_count = 0;
+            for (int i = start; i < end; i++) {
+                if (data[i].id % shards->count == shard) routed[routed_count++] = data[i];
+            }
+            int shard_result = sbuffer_shard_insert_batch(shards, shard, routed, routed_count);
+            if (shard_result != SBUFFER_SUCCESS) result = shard_result;
+        }
+    }
+    return result;
+}
@@ -10,16 +10,65 @@
 #define SBUFFER_FAILURE -1
 #define SBUFFER_SUCCESS 0
 #define SBUFFER_NO_DATA 1
+#define SBUFFER_FULL 2
+
+/**
+ * What sbuffer_insert does with a record when the buffer holds 'capacity' records
+ */
+typedef enum {
+    SBUFFER_POLICY_BLOCK,           /**< wait until the slowest stage frees a slot */
+    SBUFFER_POLICY_DROP_OLDEST,     /**< overwrite the oldest record, stages that did not read it skip it */
+    SBUFFER_POLICY_DROP_NEWEST,     /**< silently drop the new record */
+    SBUFFER_POLICY_REJECT           /**< drop the new record and return SBUFFER_FULL */
+} sbuffer_policy_t;
+
+typedef struct {
+    int capacity;                   /**< max number of records in the buffer */
+    sbuffer_policy_t policy;        /**< overflow policy when the buffer is full */
+    int high_watermark;             /**< buffer size at which producers should stop reading from their sockets */
+    int low_watermark;              /**< buffer size at which producers may continue */
+} sbuffer_options_t;
+
+typedef struct {
+    const char *name;               /**< name given at registration */
+    uint64_t records_read;          /**< records this stage has read so far */
+    uint64_t lag;                   /**< records inserted but not yet read by this stage */
+    uint64_t max_lag;               /**< largest lag seen at the start of a read */
+} sbuffer_stage_stats_t;
+
+typedef struct {
+    uint64_t inserted;              /**< records that made it into the buffer */
+    uint64_t dropped_oldest;        /**< records overwritten before every stage read them */
+    uint64_t dropped_newest;        /**< records dropped by SBUFFER_POLICY_DROP_NEWEST */
+    uint64_t rejected;              /**< records refused by SBUFFER_POLICY_REJECT */
+    uint64_t size;                  /**< records currently waiting for at least one stage */
+    uint64_t capacity;
+} sbuffer_stats_t;
 
 typedef struct sbuffer sbuffer_t;
+typedef struct sbuffer_shards sbuffer_shards_t;
 
 /**
- * Allocates and initializes a new shared buffer
+ * Allocates and initializes a new shared buffer with the default options (see sbuffer_default_options)
  * \param buffer a double pointer to the buffer that needs to be initialized
  * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred
  */
 int sbuffer_init(sbuffer_t **buffer);
 
+/**
+ * Allocates and initializes a new shared buffer, all memory for 'options->capacity' records is allocated here
+ * \param buffer a double pointer to the buffer that needs to be initialized
+ * \param options capacity, overflow policy and watermarks, low <= high <= capacity
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred or the options are invalid
+ */
+int sbuffer_init_with_options(sbuffer_t **buffer, const sbuffer_options_t *options);
+
+/**
+ * Fills 'options' with SBUFFER_CAPACITY, SBUFFER_POLICY_BLOCK and the SBUFFER_*_WATERMARK percentages
+ * \param options a pointer to the options to fill
+ */
+void sbuffer_default_options(sbuffer_options_t *options);
+
 /**
  * All allocated resources are freed and cleaned up
  * \param buffer a double pointer to the buffer that needs to be freed
@@ -28,35 +77,215 @@ int sbuffer_init(sbuffer_t **buffer);
 int sbuffer_free(sbuffer_t **buffer);
 
 /**
- * Removes the first sensor data in 'buffer' (at the 'head') and returns this sensor data as '*data'
- * If 'buffer' is empty, the function doesn't block until new sensor data becomes available but returns SBUFFER_NO_DATA
- * \param buffer a pointer to the buffer that is used
- * \param data a pointer to pre-allocated sensor_data_t space, the data will be copied into this structure. No new memory is allocated for 'data' in this function.
- * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred
+ * Registers a new consumer of 'buffer' and returns its stage id, to be used with sbuffer_read(_batch)
+ * Every stage has its own cursor and condition variable and reads every record inserted after its
+ * registration. A slot is only reused once every registered stage has read it. Each stage id must be
+ * read by one thread only. Register all stages before the producers start.
+ * \param buffer a pointer to the buffer
+ * \param name a short name used in the lag metrics
+ * \return the stage id (1 to SBUFFER_MAX_STAGES) or SBUFFER_FAILURE if no stage could be added
  */
-int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data);
+int sbuffer_register_stage(sbuffer_t *buffer, const char *name);
 
 /**
- * Inserts the sensor data in 'data' at the end of 'buffer' (at the 'tail')
+ * Removes a consumer of 'buffer', the records it did not read yet no longer hold their slots
+ * A stage that stops before the end marker must call this, or the buffer fills up and the producers block on it.
+ * Only the thread reading the stage may call this, and it must not read the stage afterwards.
+ * \param buffer a pointer to the buffer
+ * \param stage_id stage id returned by sbuffer_register_stage
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if the stage is not registered
+ */
+int sbuffer_unregister_stage(sbuffer_t *buffer, int stage_id);
+
+/**
+ * Inserts the sensor data in 'data' at the end of 'buffer' (at the 'head' of the ring)
+ * If the buffer is full, the overflow policy decides: block until the slowest stage has read the oldest
+ * record, drop the oldest record, drop 'data' or reject 'data'. The end marker (id 0) always blocks.
  * \param buffer a pointer to the buffer that is used
  * \param data a pointer to sensor_data_t data, that will be copied into the buffer
- * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occured
+ * \return SBUFFER_SUCCESS on success, SBUFFER_FULL if rejected and SBUFFER_FAILURE if an error occured
 */
 int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data);
+
+/**
+ * Inserts 'count' records from 'data' at the end of 'buffer' with a single lock acquisition and a single wake-up
+ * If the buffer fills up, the overflow policy is applied to the records that do not fit (see sbuffer_insert)
+ * \param buffer a pointer to the buffer that is used
+ * \param data an array of 'count' records, that will be copied into the buffer in order
+ * \param count the number of records in 'data'
+ * \return SBUFFER_SUCCESS on success, SBUFFER_FULL if records were rejected and SBUFFER_FAILURE if an error occured
+*/
+int sbuffer_insert_batch(sbuffer_t *buffer, sensor_data_t *data, int count);
 /**
- * Reads sensor data from a specific processing stage
- * Updates the stage to the next level after reading
+ * Reads the next sensor data for a specific processing stage
+ * Every stage has its own read cursor, so stages never wait on each other. Blocks while the stage
+ * has read everything that was inserted. A slot is freed once all stages have read it.
  * @param buffer Pointer to the buffer
  * @param data Pointer to store the read sensor data
- * @param stage_id
- * @return SBUFFER_SUCCESS on success, SBUFFER_FAILURE on error, SBUFFER_NO_DATA if buffer is empty
+ * @param stage_id stage id returned by sbuffer_register_stage
+ * @return SBUFFER_SUCCESS on success, SBUFFER_FAILURE on error, SBUFFER_NO_DATA if the end marker (id 0) is reached
  */
 int sbuffer_read(sbuffer_t *buffer, sensor_data_t *data, int stage_id);
 
+/**
+ * Reads up to 'max_count' records for a specific processing stage with a single lock acquisition
+ * Blocks until at least one record is available. Reading stops in front of the end marker, so the
+ * records before it are returned first and the next call returns SBUFFER_NO_DATA.
+ * @param buffer Pointer to the buffer
+ * @param data Array of at least 'max_count' records to store the read sensor data
+ * @param max_count maximum number of records to read
+ * @param count Pointer to store the number of records that were read
+ * @param stage_id stage id returned by sbuffer_register_stage
+ * @return SBUFFER_SUCCESS if *count > 0, SBUFFER_FAILURE on error, SBUFFER_NO_DATA if the end marker (id 0) is reached
+ */
+int sbuffer_read_batch(sbuffer_t *buffer, sensor_data_t *data, int max_count, int *count, int stage_id);
+
 /**
  * Check if buffer is fully processed and ready for shutdown
  * \param buffer a pointer to the buffer
- * \return true if buffer is ready for shutdown
+ * \return true if every stage has read every inserted record
  */
 bool sbuffer_is_empty(sbuffer_t *buffer);
+
+/**
+ * Blocks while 'buffer' is above its high watermark, until the stages have brought it down to the low watermark
+ * Producers call this before reading more data, so a full buffer pushes back on the senders
+ * \param buffer a pointer to the buffer
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_wait_below_watermark(sbuffer_t *buffer);
+
+/**
+ * Copies the lag metrics of one stage into 'stats'
+ * \param buffer a pointer to the buffer
+ * \param stage_id stage id returned by sbuffer_register_stage
+ * \param stats a pointer to pre-allocated space for the metrics, 'stats->name' points into the buffer
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if the stage is not registered
+ */
+int sbuffer_get_stage_stats(sbuffer_t *buffer, int stage_id, sbuffer_stage_stats_t *stats);
+
+/**
+ * Copies the overload counters and the current size of 'buffer' into 'stats'
+ * \param buffer a pointer to the buffer
+ * \param stats a pointer to pre-allocated space for the counters
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_get_stats(sbuffer_t *buffer, sbuffer_stats_t *stats);
+
+/**
+ * Allocates 'count' independent buffers, each with its own lock, to run several pipelines side by side
+ * Records are routed to a shard by their sensor id, so readings of one sensor always stay in order
+ * \param shards a double pointer to the shard set that needs to be initialized
+ * \param count the number of buffers, at least 1
+ * \param options options for every buffer, NULL for the defaults
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_shards_init(sbuffer_shards_t **shards, int count, const sbuffer_options_t *options);
+
+/**
+ * Frees every buffer in the shard set and the set itself
+ * \param shards a double pointer to the shard set that needs to be freed
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_shards_free(sbuffer_shards_t **shards);
+
+/**
+ * Creates a shard set with only shard 'index' of 'shards', so every record inserted through it lands in that buffer
+ * The view shares the buffer, sbuffer_shards_free on the view frees the view only
+ * \param view a double pointer to the view that needs to be initialized
+ * \param shards a pointer to the shard set
+ * \param index the shard number, 0 to count - 1
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_shards_view(sbuffer_shards_t **view, sbuffer_shards_t *shards, int index);
+
+/**
+ * Gives every shard 'partitions' partition buffers of its own, so several workers of one stage can split a shard
+ * From then on every record inserted in a shard is also copied into the partition buffer its sensor id maps to
+ * (see sbuffer_partition_of), in order, and a stage registered with sbuffer_shards_register_partition_stage only
+ * reads the sensors of its own partition. Call it right after sbuffer_shards_init, before any view is created.
+ * \param shards a pointer to the shard set, not a view
+ * \param partitions the number of partition buffers per shard, 1 leaves the set as it is
+ * \param options options for every partition buffer, NULL for the defaults
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_shards_partition(sbuffer_shards_t *shards, int partitions, const sbuffer_options_t *options);
+
+/**
+ * Registers the same stage on every partition buffer of every shard, or on every shard if the set is not partitioned
+ * \param shards a pointer to the shard set
+ * \param name a short name used in the lag metrics
+ * \return the stage id, identical on every partition buffer, or SBUFFER_FAILURE
+ */
+int sbuffer_shards_register_partition_stage(sbuffer_shards_t *shards, const char *name);
+
+/**
+ * \param shards a pointer to the shard set
+ * \return the number of partition buffers per shard, 1 if the set is not partitioned, 0 if 'shards' is NULL
+ */
+int sbuffer_shards_partition_count(sbuffer_shards_t *shards);
+
+/**
+ * \param shards a pointer to the shard set
+ * \param index the shard number, 0 to count - 1
+ * \param partition the partition number, 0 to the partition count - 1
+ * \return the partition buffer, the shard itself if the set is not partitioned, or NULL if an index is invalid
+ */
+sbuffer_t *sbuffer_partition_at(sbuffer_shards_t *shards, int index, int partition);
+
+/**
+ * Spreads sensor ids evenly over 'partitions', also ids that are already spread over shards by their remainder
+ * \param id the sensor id to route
+ * \param partitions the number of partitions, at least 1
+ * \return the partition of 'id', 0 to partitions - 1
+ */
+int sbuffer_partition_of(sensor_id_t id, int partitions);
+
+/**
+ * Registers the same stage on every shard, see sbuffer_register_stage
+ * \param shards a pointer to the shard set
+ * \param name a short name used in the lag metrics
+ * \return the stage id, identical on every shard, or SBUFFER_FAILURE
+ */
+int sbuffer_shards_register_stage(sbuffer_shards_t *shards, const char *name);
+
+/**
+ * \param shards a pointer to the shard set
+ * \return the number of buffers in the set, 0 if 'shards' is NULL
+ */
+int sbuffer_shards_count(sbuffer_shards_t *shards);
+
+/**
+ * \param shards a pointer to the shard set
+ * \param index the shard number, 0 to count - 1
+ * \return the buffer at 'index' or NULL if the index is invalid
+ */
+sbuffer_t *sbuffer_shard_at(sbuffer_shards_t *shards, int index);
+
+/**
+ * \param shards a pointer to the shard set
+ * \param id the sensor id to route
+ * \return the buffer that owns all readings of sensor 'id'
+ */
+sbuffer_t *sbuffer_shard_for(sbuffer_shards_t *shards, sensor_id_t id);
+
+/**
+ * Inserts 'data' in the shard that owns its sensor id, and in its partition buffer if the set is partitioned
+ * The end marker (id 0) is inserted in every shard and partition buffer, so all stages of all pipelines stop
+ * \param shards a pointer to the shard set
+ * \param data a pointer to sensor_data_t data, that will be copied into the buffer
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occured
+ */
+int sbuffer_shards_insert(sbuffer_shards_t *shards, sensor_data_t *data);
+
+/**
+ * Inserts 'count' records in the shards that own their sensor ids, one sbuffer_insert_batch per shard
+ * and one per partition buffer that gets records
+ * 'data' must not contain the end marker, use sbuffer_shards_insert for that
+ * \param shards a pointer to the shard set
+ * \param data an array of 'count' records
+ * \param count the number of records in 'data'
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occured
+ */
+int sbuffer_shards_insert_batch(sbuffer_shards_t *shards, sensor_data_t *data, int count);
 #endif //SBUFFER_H
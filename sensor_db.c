@@ -9,7 +9,8 @@
 
 void *storage_manager(void *args) {
     storagemanager_arguments_t *params = (storagemanager_arguments_t*)args; //explicit casting
-    sensor_data_t data;
+    sensor_data_t batch[SBUFFER_BATCH_SIZE];
+    int count;
 
     FILE *fp = open_db("data.csv");
     if (!fp) {
@@ -21,24 +22,26 @@ void *storage_manager(void *args) {
 
     // process data from buffer
     while (1) {
-        int result = sbuffer_read(params->sBuffer, &data, 2);  // stage 2 = storage manager
+        int result = sbuffer_read_batch(params->sBuffer, batch, SBUFFER_BATCH_SIZE, &count, params->stage_id);
 
         if (result == SBUFFER_NO_DATA) {
             break;  // End marker received
         }
 
         if (result == SBUFFER_SUCCESS) {
-            if (write_sensor_data(fp, &data) == 0) {
-                char log[300];
-                snprintf(log, sizeof(log), "Data insertion from sensor %d succeeded", data.id);
-                write_to_log_process(log);
-            } else {
-                write_to_log_process("Failed to write sensor data");
+            for (int i = 0; i < count; i++) {
+                if (write_sensor_data(fp, &batch[i]) == 0) {
+                    char log[300];
+                    snprintf(log, sizeof(log), "Data insertion from sensor %d succeeded", batch[i].id);
+                    write_to_log_process(log);
+                } else {
+                    write_to_log_process("Failed to write sensor data");
+                }
             }
+        } else {
+            write_to_log_process("Error reading from buffer in storage manager");
+            break;
         }
-
-        //remove from buffer after reading/writing
-        sbuffer_remove(params->sBuffer, &data);
     }
     close_db(fp);
     write_to_log_process("Storage manager shutting down");
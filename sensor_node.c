@@ -54,6 +54,8 @@
 
 
 void print_help(void);
+int negotiate_version(tcpsock_t *client, sensor_id_t id);
+void send_frame(tcpsock_t *client, char *frame, int readings);
 
 /**
  * For starting the sensor node 4 command line arguments are needed. These should be given in the order below
@@ -63,6 +65,8 @@ void print_help(void);
  * argv[2] = sleep time
  * argv[3] = server IP
  * argv[4] = server port
+ * argv[5] = (optional) readings per frame, switches to protocol v2 when the gateway supports it
+ * argv[6] = (optional) max seconds a reading is held back before a partial frame is sent
  */
 
 int main(int argc, char *argv[]) {
@@ -71,10 +75,16 @@ int main(int argc, char *argv[]) {
     char server_ip[] = "000.000.000.000";
     tcpsock_t *client;
     int i, bytes, sleep_time;
+    int batch_size = 0;
+    int flush_interval = PROTOCOL_FLUSH_INTERVAL;
+    int version = 1;
+    char frame[FRAME_HEADER_SIZE + PROTOCOL_MAX_READINGS * FRAME_READING_SIZE];
+    int frame_readings = 0;
+    time_t frame_started = 0;
 
     LOG_OPEN();
 
-    if (argc != 5) {
+    if (argc < 5 || argc > 7) {
         print_help();
         exit(EXIT_SUCCESS);
     } else {
@@ -83,29 +93,47 @@ int main(int argc, char *argv[]) {
         sleep_time = atoi(argv[2]);
         strncpy(server_ip, argv[3], strlen(server_ip));
         server_port = atoi(argv[4]);
+        if (argc > 5) batch_size = atoi(argv[5]);
+        if (argc > 6) flush_interval = atoi(argv[6]);
+        if (batch_size > PROTOCOL_MAX_READINGS) batch_size = PROTOCOL_MAX_READINGS;
     }
 
     srand48(time(NULL));
 
     // open TCP connection to the server; server is listening to SERVER_IP and PORT
     if (tcp_active_open(&client, server_port, server_ip) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+    if (batch_size > 0) version = negotiate_version(client, data.id);
     data.value = INITIAL_TEMPERATURE;
     i = LOOPS;
     while (i) {
         data.value = data.value + TEMP_DEV * ((drand48() - 0.5) / 10);
         time(&data.ts);
-        // send data to server in this order (!!): <sensor_id><temperature><timestamp>
-        // remark: don't send as a struct!
-        bytes = sizeof(data.id);
-        if (tcp_send(client, (void *) &data.id, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
-        bytes = sizeof(data.value);
-        if (tcp_send(client, (void *) &data.value, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
-        bytes = sizeof(data.ts);
-        if (tcp_send(client, (void *) &data.ts, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+        if (version == 1) {
+            // send data to server in this order (!!): <sensor_id><temperature><timestamp>
+            // remark: don't send as a struct!
+            char record[RECORD_SIZE];
+            memcpy(record, &data.id, sizeof(data.id));
+            memcpy(record + sizeof(data.id), &data.value, sizeof(data.value));
+            memcpy(record + sizeof(data.id) + sizeof(data.value), &data.ts, sizeof(data.ts));
+            bytes = RECORD_SIZE;
+            if (tcp_send(client, (void *) record, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+        } else {
+            // v2: collect <temperature><timestamp> pairs behind the frame header
+            char *reading = frame + FRAME_HEADER_SIZE + frame_readings * FRAME_READING_SIZE;
+            memcpy(reading, &data.value, sizeof(data.value));
+            memcpy(reading + sizeof(data.value), &data.ts, sizeof(data.ts));
+            if (frame_readings++ == 0) frame_started = data.ts;
+            // flush when the frame is full or the next reading would come too late
+            if (frame_readings == batch_size || data.ts + sleep_time - frame_started >= flush_interval) {
+                send_frame(client, frame, frame_readings);
+                frame_readings = 0;
+            }
+        }
         LOG_PRINTF(data.id, data.value, data.ts);
         sleep(sleep_time);
         UPDATE(i);
     }
+    if (frame_readings > 0) send_frame(client, frame, frame_readings);
 
     if (tcp_close(&client) != TCP_NO_ERROR) exit(EXIT_FAILURE);
 
@@ -123,4 +151,39 @@ void print_help(void) {
     printf("\t%-15s : node sleep time (in sec) between two measurements\n", "\'sleep time\'");
     printf("\t%-15s : TCP server IP address\n", "\'server IP\'");
     printf("\t%-15s : TCP server port number\n", "\'server port\'");
+    printf("Optionally followed by: \n");
+    printf("\t%-15s : readings per frame (max %d), uses protocol v2 if the gateway supports it\n", "\'batch size\'",
+           PROTOCOL_MAX_READINGS);
+    printf("\t%-15s : max seconds a reading is held back (default %d)\n", "\'flush time\'", PROTOCOL_FLUSH_INTERVAL);
+}
+
+/**
+ * Sends the v2 handshake for sensor 'id' and waits for the gateway's answer
+ * \return the protocol version the gateway agreed to
+ */
+int negotiate_version(tcpsock_t *client, sensor_id_t id) {
+    uint16_t handshake[4] = {0, PROTOCOL_MAGIC, PROTOCOL_VERSION, id};
+    uint16_t reply[2];
+    int bytes = HANDSHAKE_SIZE;
+    if (tcp_send(client, (void *) handshake, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+
+    tcp_set_receive_timeout(client, TIMEOUT);
+    int received = 0;
+    while (received < (int) HANDSHAKE_REPLY_SIZE) {
+        bytes = HANDSHAKE_REPLY_SIZE - received;
+        if (tcp_receive(client, (char *) reply + received, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+        received += bytes;
+    }
+    if (reply[0] != PROTOCOL_MAGIC || reply[1] < 2) exit(EXIT_FAILURE);
+    return reply[1];
+}
+
+/**
+ * Fills in the header of 'frame' and sends it with its 'readings' readings in one go
+ */
+void send_frame(tcpsock_t *client, char *frame, int readings) {
+    uint16_t count = readings;
+    memcpy(frame, &count, sizeof(count));
+    int bytes = FRAME_HEADER_SIZE + readings * FRAME_READING_SIZE;
+    if (tcp_send(client, (void *) frame, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
 }
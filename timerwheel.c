@@ -0,0 +1,137 @@
+//
+// Created by sodir on 10/17/26.
+//
+#define _GNU_SOURCE
+
+#include "timerwheel.h"
+#include <stdlib.h>
+#include <time.h>
+
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_BITS)
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define MAX_DELTA ((1ULL << LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1)   // ticks covered by all levels
+
+struct timer_wheel {
+    uint64_t current;               /**< the last tick that was processed */
+    uint64_t tick_ms;
+    timer_entry_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+uint64_t timer_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+int timer_wheel_init(timer_wheel_t **wheel, int tick_ms, uint64_t now_ms) {
+    if (wheel == NULL || tick_ms < 1) return TIMER_FAILURE;
+    timer_wheel_t *new_wheel = calloc(1, sizeof(timer_wheel_t));
+    if (new_wheel == NULL) return TIMER_FAILURE;
+    new_wheel->tick_ms = (uint64_t)tick_ms;
+    new_wheel->current = now_ms / new_wheel->tick_ms;
+    *wheel = new_wheel;
+    return TIMER_SUCCESS;
+}
+
+int timer_wheel_free(timer_wheel_t **wheel) {
+    if (wheel == NULL || *wheel == NULL) return TIMER_FAILURE;
+    free(*wheel);
+    *wheel = NULL;
+    return TIMER_SUCCESS;
+}
+
+void timer_entry_init(timer_entry_t *entry) {
+    entry->expires = 0;
+    entry->prev = NULL;
+    entry->next = NULL;
+    entry->slot = NULL;
+}
+
+bool timer_entry_pending(timer_entry_t *entry) {
+    return entry != NULL && entry->slot != NULL;
+}
+
+static void unlink_entry(timer_entry_t *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else *entry->slot = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+    entry->slot = NULL;
+}
+
+/**
+ * Puts 'entry' in the lowest level whose slots still distinguish its expiry tick from the current one,
+ * a level l slot is cascaded to the levels below when the current tick reaches its first tick
+ */
+static void link_entry(timer_wheel_t *wheel, timer_entry_t *entry) {
+    uint64_t delta = entry->expires - wheel->current;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << LEVEL_SHIFT(level + 1))) {
+        level++;
+    }
+    timer_entry_t **slot = &wheel->slots[level][(entry->expires >> LEVEL_SHIFT(level)) & SLOT_MASK];
+    entry->prev = NULL;
+    entry->next = *slot;
+    if (*slot) (*slot)->prev = entry;
+    *slot = entry;
+    entry->slot = slot;
+}
+
+int timer_wheel_schedule(timer_wheel_t *wheel, timer_entry_t *entry, uint64_t expires_ms) {
+    if (wheel == NULL || entry == NULL) return TIMER_FAILURE;
+    if (entry->slot) unlink_entry(entry);
+
+    // round up, a timer never fires early
+    uint64_t expires = (expires_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    if (expires <= wheel->current) expires = wheel->current + 1;
+    if (expires - wheel->current > MAX_DELTA) expires = wheel->current + MAX_DELTA;
+    entry->expires = expires;
+    link_entry(wheel, entry);
+    return TIMER_SUCCESS;
+}
+
+int timer_wheel_cancel(timer_wheel_t *wheel, timer_entry_t *entry) {
+    if (wheel == NULL || entry == NULL) return TIMER_FAILURE;
+    if (entry->slot) unlink_entry(entry);
+    return TIMER_SUCCESS;
+}
+
+/**
+ * Re-inserts every entry of a higher level slot, they all expire within the range of the levels below now
+ */
+static void cascade(timer_wheel_t *wheel, int level, int index) {
+    timer_entry_t *entry = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    while (entry) {
+        timer_entry_t *next = entry->next;
+        link_entry(wheel, entry);
+        entry = next;
+    }
+}
+
+int timer_wheel_advance(timer_wheel_t *wheel, uint64_t now_ms, timer_callback_t expire, void *arg, int *count) {
+    if (wheel == NULL || expire == NULL) return TIMER_FAILURE;
+    uint64_t target = now_ms / wheel->tick_ms;
+    int expired = 0;
+
+    while (wheel->current < target) {
+        wheel->current++;
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (wheel->current & ((1ULL << LEVEL_SHIFT(level)) - 1)) break;
+            cascade(wheel, level, (wheel->current >> LEVEL_SHIFT(level)) & SLOT_MASK);
+        }
+
+        // take entries one by one, a callback may cancel or free the next one (entries it schedules land in later ticks)
+        timer_entry_t **slot = &wheel->slots[0][wheel->current & SLOT_MASK];
+        while (*slot) {
+            timer_entry_t *entry = *slot;
+            unlink_entry(entry);
+            expired++;
+            expire(entry, arg);
+        }
+    }
+
+    if (count) *count = expired;
+    return TIMER_SUCCESS;
+}
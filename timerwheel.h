@@ -0,0 +1,99 @@
+//
+// Created by sodir on 10/17/26.
+//
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_SUCCESS 0
+#define TIMER_FAILURE -1
+
+#define TIMER_WHEEL_LEVELS 4        // a level of slots covers 64 times the time of the level below
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+/**
+ * a timer, embedded in the structure it belongs to (see timer_entry_owner)
+ * the wheel only links entries, it never allocates or frees them
+ */
+typedef struct timer_entry {
+    uint64_t expires;               /**< tick at which the timer fires */
+    struct timer_entry *prev;
+    struct timer_entry *next;
+    struct timer_entry **slot;      /**< head of the slot list holding the entry, NULL when not scheduled */
+} timer_entry_t;
+
+typedef struct timer_wheel timer_wheel_t;
+
+/**
+ * Called for every expired entry, the entry is no longer scheduled and may be scheduled again,
+ * other entries may be scheduled or cancelled, and the structure owning the entry may be freed
+ */
+typedef void (*timer_callback_t)(timer_entry_t *entry, void *arg);
+
+/**
+ * \return the structure of type 'type' that holds 'entry' as its member 'member'
+ */
+#define timer_entry_owner(entry, type, member) ((type *)((char *)(entry) - offsetof(type, member)))
+
+/**
+ * \return the current time in milliseconds on the monotonic clock, without a system call (vDSO)
+ */
+uint64_t timer_now_ms();
+
+/**
+ * Creates a hierarchical timer wheel: TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots, the first level
+ * has a slot per tick, so scheduling, cancelling and expiring an entry is O(1) regardless of how many are scheduled
+ * Deadlines further away than the wheel covers fire at the end of the last level
+ * The wheel is not thread safe, the caller serializes all calls on one wheel
+ * \param wheel a double pointer, that will be filled out with the new wheel
+ * \param tick_ms the resolution of the wheel in milliseconds, timers fire at most one tick late
+ * \param now_ms the current time on the clock the caller schedules with, usually timer_now_ms()
+ * \return TIMER_SUCCESS on success and TIMER_FAILURE if an error occurred
+ */
+int timer_wheel_init(timer_wheel_t **wheel, int tick_ms, uint64_t now_ms);
+
+/**
+ * Frees the wheel, the entries that are still scheduled are left as they are
+ * \param wheel a double pointer to the wheel, set to NULL afterwards
+ * \return TIMER_SUCCESS on success and TIMER_FAILURE if an error occurred
+ */
+int timer_wheel_free(timer_wheel_t **wheel);
+
+/**
+ * Prepares an entry that was never scheduled, call it once before the first timer_wheel_schedule
+ */
+void timer_entry_init(timer_entry_t *entry);
+
+/**
+ * \return true if 'entry' is scheduled on a wheel
+ */
+bool timer_entry_pending(timer_entry_t *entry);
+
+/**
+ * Schedules 'entry' to fire at 'expires_ms', moving it if it was scheduled already
+ * A deadline in the past fires at the next tick
+ * \return TIMER_SUCCESS on success and TIMER_FAILURE if an error occurred
+ */
+int timer_wheel_schedule(timer_wheel_t *wheel, timer_entry_t *entry, uint64_t expires_ms);
+
+/**
+ * Removes 'entry' from the wheel, nothing happens if it is not scheduled
+ * \return TIMER_SUCCESS on success and TIMER_FAILURE if an error occurred
+ */
+int timer_wheel_cancel(timer_wheel_t *wheel, timer_entry_t *entry);
+
+/**
+ * Advances the wheel to 'now_ms', calling 'expire' for every entry that expired on the way
+ * Time never goes back: a 'now_ms' before the latest one does nothing
+ * Call it regularly, every tick that passed costs O(1) when no timer expires
+ * \param count a pointer to an int that will hold the number of expired entries, may be NULL
+ * \return TIMER_SUCCESS on success and TIMER_FAILURE if an error occurred
+ */
+int timer_wheel_advance(timer_wheel_t *wheel, uint64_t now_ms, timer_callback_t expire, void *arg, int *count);
+
+#endif //TIMERWHEEL_H
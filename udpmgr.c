@@ -0,0 +1,234 @@
+//
+// Created by sodir on 10/17/26.
+//
+#define _GNU_SOURCE
+
+#include "udpmgr.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#define UDP_SEQUENCE_WINDOW 64  // sequence numbers remembered per sensor, the bits of udp_sensor_stats_t.received
+
+/**
+ * what the UDP listener knows about one sensor
+ */
+typedef struct udp_sensor_stats {
+    uint64_t readings;
+    uint64_t datagrams;             /**< sequenced datagrams only, v1 datagrams carry no sequence number */
+    uint64_t lost;                  /**< sequence numbers skipped and not (yet) received */
+    uint64_t late;                  /**< datagrams that arrived after a later one, filling a gap counted as lost */
+    uint64_t duplicates;            /**< datagrams received twice, too old to tell, or from before counting (re)started */
+    uint32_t next_sequence;
+    uint64_t received;              /**< bit i is set once sequence number next_sequence - 1 - i arrived */
+} udp_sensor_stats_t;
+
+typedef struct udp_listener {
+    int sd;
+    udp_sensor_stats_t *sensors;    /**< indexed by sensor id */
+    uint64_t datagrams;
+    uint64_t malformed;
+} udp_listener_t;
+
+static int udp_open(int port) {
+    int sd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sd < 0) return -1;
+
+    int reuse = 1;
+    int receive_buffer = UDP_RECEIVE_BUFFER;
+    struct timeval timeout = {.tv_sec = ACCEPT_POLL_MS / 1000, .tv_usec = (ACCEPT_POLL_MS % 1000) * 1000};
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY)};
+    // a smaller receive buffer than requested is fine, the kernel caps it at net.core.rmem_max
+    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+    if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+        setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        bind(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+static void sensor_seen(udp_listener_t *listener, sensor_id_t sensor_id, int readings) {
+    udp_sensor_stats_t *stats = &listener->sensors[sensor_id];
+    if (stats->readings == 0 && stats->datagrams == 0) {
+        char log_message[LOG_MSG_MAX_LEN];
+        snprintf(log_message, sizeof(log_message), "Sensor node %d sends over UDP", sensor_id);
+        write_to_log_process(log_message);
+    }
+    stats->readings += readings;
+}
+
+/**
+ * Updates the loss counters of a sensor with the sequence number of its latest datagram
+ * A sequence number of 0 starts counting anew, the node (re)started. Only the last UDP_SEQUENCE_WINDOW
+ * sequence numbers are remembered: a datagram older than that cannot be told from a replay
+ */
+static void count_sequence(udp_sensor_stats_t *stats, uint32_t sequence) {
+    stats->datagrams++;
+    if (stats->datagrams == 1 || sequence == 0) {
+        // whatever was sent before is not counted as lost, so it cannot arrive late either
+        stats->next_sequence = sequence + 1;
+        stats->received = ~(uint64_t)0;
+        return;
+    }
+
+    int32_t gap = (int32_t)(sequence - stats->next_sequence);
+    if (gap >= 0) {
+        stats->lost += gap;
+        stats->received = (gap + 1 < UDP_SEQUENCE_WINDOW) ? (stats->received << (gap + 1)) | 1 : 1;
+        stats->next_sequence = sequence + 1;
+        return;
+    }
+
+    int behind = -gap - 1;  // 0 is the highest sequence number received
+    uint64_t bit = (uint64_t)1 << behind;
+    if (behind >= UDP_SEQUENCE_WINDOW || (stats->received & bit)) {
+        stats->duplicates++;
+        return;
+    }
+    //counted as lost when the gap was seen
+    stats->received |= bit;
+    stats->late++;
+    stats->lost--;
+}
+
+/**
+ * Unpacks the readings of one datagram into 'out', which has room for UDP_MAX_READINGS readings
+ * (a datagram of v1 readings holds fewer, they are larger)
+ * \return the number of readings, or -1 if the datagram does not match either format
+ */
+static int take_datagram(udp_listener_t *listener, uint8_t *datagram, int size, sensor_data_t *out) {
+    sensor_id_t first;
+    if (size < (int)sizeof(first)) return -1;
+    memcpy(&first, datagram, sizeof(first));
+
+    if (first != 0) {
+        if (size % RECORD_SIZE != 0) return -1;
+        int count = size / RECORD_SIZE;
+        for (int i = 0; i < count; i++, datagram += RECORD_SIZE) {
+            sensor_data_t *data = &out[i];
+            memcpy(&data->id, datagram, sizeof(data->id));
+            memcpy(&data->value, datagram + sizeof(data->id), sizeof(data->value));
+            memcpy(&data->ts, datagram + sizeof(data->id) + sizeof(data->value), sizeof(data->ts));
+            if (data->id == 0) return -1;  // would be taken for the end marker
+        }
+        for (int i = 0; i < count; i++) {
+            sensor_seen(listener, out[i].id, 1);
+        }
+        return count;
+    }
+
+    if (size < (int)UDP_HEADER_SIZE) return -1;
+    uint16_t fields[4];  // <0><magic><sensor_id><reading count>
+    uint32_t sequence;
+    memcpy(fields, datagram, sizeof(fields));
+    memcpy(&sequence, datagram + sizeof(fields), sizeof(sequence));
+    int count = fields[3];
+    if (fields[1] != PROTOCOL_MAGIC || fields[2] == 0 || count == 0 ||
+        size != (int)(UDP_HEADER_SIZE + count * FRAME_READING_SIZE)) return -1;
+
+    datagram += UDP_HEADER_SIZE;
+    for (int i = 0; i < count; i++, datagram += FRAME_READING_SIZE) {
+        sensor_data_t *data = &out[i];
+        data->id = fields[2];
+        memcpy(&data->value, datagram, sizeof(data->value));
+        memcpy(&data->ts, datagram + sizeof(data->value), sizeof(data->ts));
+    }
+    sensor_seen(listener, fields[2], count);
+    count_sequence(&listener->sensors[fields[2]], sequence);
+    return count;
+}
+
+static void log_udp_stats(udp_listener_t *listener) {
+    char log_message[LOG_MSG_MAX_LEN];
+    snprintf(log_message, sizeof(log_message), "UDP listener: %lu datagrams, %lu malformed",
+             (unsigned long)listener->datagrams, (unsigned long)listener->malformed);
+    write_to_log_process(log_message);
+
+    for (int id = 1; id < SENSOR_ID_COUNT; id++) {
+        udp_sensor_stats_t *stats = &listener->sensors[id];
+        if (stats->readings == 0) continue;
+        snprintf(log_message, sizeof(log_message),
+                 "UDP sensor %d: %lu readings, %lu sequenced datagrams, %lu lost, %lu late, %lu duplicate",
+                 id, (unsigned long)stats->readings, (unsigned long)stats->datagrams,
+                 (unsigned long)stats->lost, (unsigned long)stats->late, (unsigned long)stats->duplicates);
+        write_to_log_process(log_message);
+    }
+}
+
+void *udp_manager(void *args) {
+    udp_manager_arguments_t *params = (udp_manager_arguments_t*)args;
+    udp_listener_t listener = {.sd = udp_open(params->port)};
+    if (listener.sd < 0) {
+        write_to_log_process("Failed to open UDP socket");
+        return NULL;
+    }
+
+    // one recvmmsg call fills up to UDP_BATCH datagram buffers, their readings go into the buffer in one batch
+    uint8_t *datagrams = malloc((size_t)UDP_BATCH * UDP_MAX_DATAGRAM);
+    struct mmsghdr *messages = calloc(UDP_BATCH, sizeof(struct mmsghdr));
+    struct iovec *iovecs = calloc(UDP_BATCH, sizeof(struct iovec));
+    sensor_data_t *readings = malloc(sizeof(sensor_data_t) * UDP_BATCH * UDP_MAX_READINGS);
+    listener.sensors = calloc(SENSOR_ID_COUNT, sizeof(udp_sensor_stats_t));
+    if (!datagrams || !messages || !iovecs || !readings || !listener.sensors) {
+        write_to_log_process("Failed to allocate UDP receive buffers");
+        free(datagrams);
+        free(messages);
+        free(iovecs);
+        free(readings);
+        free(listener.sensors);
+        close(listener.sd);
+        return NULL;
+    }
+    for (int i = 0; i < UDP_BATCH; i++) {
+        iovecs[i].iov_base = datagrams + (size_t)i * UDP_MAX_DATAGRAM;
+        iovecs[i].iov_len = UDP_MAX_DATAGRAM;
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    char log_message[LOG_MSG_MAX_LEN];
+    snprintf(log_message, sizeof(log_message), "UDP listener started on port %d", params->port);
+    write_to_log_process(log_message);
+
+    while (!atomic_load(&params->stop)) {
+        // blocks until the first datagram or the receive timeout, then takes whatever else is queued
+        int received = recvmmsg(listener.sd, messages, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+            write_to_log_process("UDP listener encountered a socket error");
+            break;
+        }
+
+        int count = 0;
+        for (int i = 0; i < received; i++) {
+            listener.datagrams++;
+            int taken = -1;
+            if (!(messages[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+                taken = take_datagram(&listener, iovecs[i].iov_base, (int)messages[i].msg_len, &readings[count]);
+            }
+            if (taken < 0) {
+                listener.malformed++;
+                continue;
+            }
+            count += taken;
+        }
+        sbuffer_shards_insert_batch(params->sBuffers, readings, count);
+    }
+
+    log_udp_stats(&listener);
+    free(datagrams);
+    free(messages);
+    free(iovecs);
+    free(readings);
+    free(listener.sensors);
+    close(listener.sd);
+    write_to_log_process("UDP listener shutting down");
+    return NULL;
+}
@@ -0,0 +1,23 @@
+//
+// Created by sodir on 10/17/26.
+//
+
+#ifndef UDPMGR_H
+#define UDPMGR_H
+
+#include "config.h"
+#include "sbuffer.h"
+
+/**
+ * Thread function of the UDP listener, started by the connection manager next to its TCP listeners
+ * - Binds a UDP socket on 'port' and pulls up to UDP_BATCH datagrams per recvmmsg call
+ * - Accepts datagrams with one or more v1 readings, or one sequenced frame (see config.h)
+ * - Inserts all readings of one recvmmsg call into the shared buffers with a single batch insert
+ * - Counts lost and late datagrams per sensor from the sequence numbers, logged when it stops
+ * - Stops within ACCEPT_POLL_MS once 'stop' is set
+ * @param args Pointer to UDP listener parameters (udp_manager_arguments_t)
+ * @return NULL on completion, all error handling done via logging
+ */
+void *udp_manager(void *args);
+
+#endif //UDPMGR_H